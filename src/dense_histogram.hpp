@@ -0,0 +1,151 @@
+#pragma once
+
+#include <assert.h>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+#include "histogram.hpp"
+#include "quantization.hpp"
+
+// Direct-indexed histogram of colors quantized to Bits bits per component.
+// Counters live in 2^Bits pages of 2^(2 * Bits) entries, one page per level
+// of the first component; a page is allocated the first time it is touched.
+// Counting is a single streaming pass, compact() then turns the non-zero
+// bins into an ordinary Histogram<3, unsigned char, C>.
+template <unsigned Bits = 8>
+class DenseHistogram
+{
+   public:
+    typedef Quantizer<Bits> Quant;
+
+    static const size_t PAGES = Quant::LEVELS;
+    static const size_t PAGESIZE = Quant::LEVELS * Quant::LEVELS;
+    static const size_t SIZE = PAGES * PAGESIZE;
+    static_assert(PAGESIZE <= 0x10000, "entry() indices are 16-bit");
+
+   private:
+    std::vector<uint32_t *> pages;
+
+    uint32_t *page(size_t level)
+    {
+        uint32_t *&p = pages[level];
+        if(p == NULL)
+        {
+            p = new uint32_t[PAGESIZE];
+            memset(p, 0, PAGESIZE * sizeof(uint32_t));
+        }
+        return p;
+    }
+
+   public:
+    DenseHistogram() : pages(PAGES, NULL) {}
+    DenseHistogram(const DenseHistogram &) = delete;
+    DenseHistogram &operator=(const DenseHistogram &) = delete;
+    ~DenseHistogram()
+    {
+        for(size_t i = 0; i < PAGES; ++i)
+        {
+            delete[] pages[i];
+        }
+    }
+
+    // Zeroes the counters but keeps the pages allocated for the next image.
+    void reset()
+    {
+        for(size_t i = 0; i < PAGES; ++i)
+        {
+            if(pages[i] != NULL)
+            {
+                memset(pages[i], 0, PAGESIZE * sizeof(uint32_t));
+            }
+        }
+    }
+
+    // Takes full 8-bit components and quantizes them.
+    void add(unsigned char c0, unsigned char c1, unsigned char c2)
+    {
+        ++page(Quant::level(c0))[(size_t(Quant::level(c1)) << Bits) | Quant::level(c2)];
+    }
+    void add(const Key<3, unsigned char> &key) { add(key[0], key[1], key[2]); }
+    // The bin must have been counted before.
+    void remove(unsigned char c0, unsigned char c1, unsigned char c2)
+    {
+        --page(Quant::level(c0))[(size_t(Quant::level(c1)) << Bits) | Quant::level(c2)];
+    }
+    void remove(const Key<3, unsigned char> &key) { remove(key[0], key[1], key[2]); }
+
+    // Index of a color within its page, the page being Quant::level(c0).
+    static uint16_t entry(unsigned char c1, unsigned char c2)
+    {
+        return uint16_t((unsigned(Quant::level(c1)) << Bits) | Quant::level(c2));
+    }
+    // Counts n colors of page level, given by their entry() indices. Calls
+    // for different pages may run concurrently.
+    void add_page(size_t level, const uint16_t *entries, size_t n)
+    {
+        uint32_t *p = page(level);
+        for(size_t i = 0; i < n; ++i)
+        {
+            ++p[entries[i]];
+        }
+    }
+
+    // Adds the counts of other, restricted to the pages [first_page, last_page).
+    void merge(const DenseHistogram &other, size_t first_page = 0, size_t last_page = PAGES);
+
+    // Appends the non-zero bins to an empty histogram in ascending key order
+    // and builds its tree and search index. The keys are the bin centers.
+    template <typename C>
+    void compact(Histogram<3, unsigned char, C> &hist) const;
+};
+
+template <unsigned Bits>
+void DenseHistogram<Bits>::merge(const DenseHistogram &other, size_t first_page,
+                                 size_t last_page)
+{
+    for(size_t l0 = first_page; l0 < last_page; ++l0)
+    {
+        const uint32_t *src = other.pages[l0];
+        if(src == NULL)
+        {
+            continue;
+        }
+        uint32_t *dst = page(l0);
+        for(size_t i = 0; i < PAGESIZE; ++i)
+        {
+            dst[i] += src[i];
+        }
+    }
+}
+
+template <unsigned Bits>
+template <typename C>
+void DenseHistogram<Bits>::compact(Histogram<3, unsigned char, C> &hist) const
+{
+    assert(hist.size() == 0);
+    unsigned char _key[3];
+    for(size_t l0 = 0; l0 < PAGES; ++l0)
+    {
+        const uint32_t *p = pages[l0];
+        if(p == NULL)
+        {
+            continue;
+        }
+        _key[0] = Quant::value(unsigned(l0));
+        for(size_t i = 0; i < PAGESIZE; ++i)
+        {
+            if(p[i] != 0)
+            {
+                _key[1] = Quant::value(unsigned(i >> Bits));
+                _key[2] = Quant::value(unsigned(i & (Quant::LEVELS - 1)));
+                hist.append(C(p[i]), Key<3, unsigned char>(&(_key[0])));
+            }
+        }
+    }
+    std::vector<uint32_t> order(hist.size());
+    for(size_t i = 0; i < order.size(); ++i)
+    {
+        order[i] = uint32_t(i);
+    }
+    hist.build_index(order);
+}
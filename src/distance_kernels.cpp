@@ -0,0 +1,118 @@
+#include "distance_kernels.hpp"
+
+// The SIMD variants need x86 and the GCC/Clang target attribute; other
+// builds use the generic kernel.
+#if (defined(__x86_64__) || defined(__i386__)) && (defined(__GNUC__) || defined(__clang__))
+#define DISTANCE_KERNELS_X86 1
+#endif
+
+#ifdef DISTANCE_KERNELS_X86
+#include <cstring>
+#include <immintrin.h>
+
+namespace
+{
+typedef void (*Kernel)(const unsigned char *const *, size_t, size_t, const float *, size_t, uint32_t *);
+
+// Loads eight 8-bit components as float lanes
+__attribute__((target("avx2"))) inline __m256 load8(const unsigned char *p)
+{
+    return _mm256_cvtepi32_ps(
+        _mm256_cvtepu8_epi32(_mm_loadl_epi64(reinterpret_cast<const __m128i *>(p))));
+}
+
+__attribute__((target("avx2"))) void nearest_centers_avx2(const unsigned char *const *component,
+                                                          size_t begin, size_t end,
+                                                          const float *centers, size_t k,
+                                                          uint32_t *labels)
+{
+    size_t bin = begin;
+    for(; bin + 8 <= end; bin += 8)
+    {
+        const __m256 x0 = load8(component[0] + bin);
+        const __m256 x1 = load8(component[1] + bin);
+        const __m256 x2 = load8(component[2] + bin);
+        __m256 min_dist = _mm256_set1_ps(FLT_MAX);
+        __m256i nearest = _mm256_setzero_si256();
+        for(size_t cntr = 0; cntr < k; ++cntr)
+        {
+            __m256 d0 = _mm256_sub_ps(x0, _mm256_set1_ps(centers[cntr * 3 + 0]));
+            __m256 d1 = _mm256_sub_ps(x1, _mm256_set1_ps(centers[cntr * 3 + 1]));
+            __m256 d2 = _mm256_sub_ps(x2, _mm256_set1_ps(centers[cntr * 3 + 2]));
+            __m256 dist = _mm256_add_ps(
+                _mm256_add_ps(_mm256_mul_ps(d0, d0), _mm256_mul_ps(d1, d1)),
+                _mm256_mul_ps(d2, d2));
+            __m256 closer = _mm256_cmp_ps(dist, min_dist, _CMP_LT_OQ);
+            min_dist = _mm256_blendv_ps(min_dist, dist, closer);
+            nearest = _mm256_blendv_epi8(nearest, _mm256_set1_epi32(int32_t(cntr)),
+                                         _mm256_castps_si256(closer));
+        }
+        _mm256_storeu_si256(reinterpret_cast<__m256i *>(labels + (bin - begin)), nearest);
+    }
+    nearest_centers<3>(component, bin, end, centers, k, labels + (bin - begin));
+}
+
+// Loads four 8-bit components as float lanes
+__attribute__((target("sse4.1"))) inline __m128 load4(const unsigned char *p)
+{
+    int32_t bytes;
+    memcpy(&bytes, p, sizeof(bytes));
+    return _mm_cvtepi32_ps(_mm_cvtepu8_epi32(_mm_cvtsi32_si128(bytes)));
+}
+
+__attribute__((target("sse4.1"))) void nearest_centers_sse41(const unsigned char *const *component,
+                                                             size_t begin, size_t end,
+                                                             const float *centers,
+                                                             size_t k, uint32_t *labels)
+{
+    size_t bin = begin;
+    for(; bin + 4 <= end; bin += 4)
+    {
+        const __m128 x0 = load4(component[0] + bin);
+        const __m128 x1 = load4(component[1] + bin);
+        const __m128 x2 = load4(component[2] + bin);
+        __m128 min_dist = _mm_set1_ps(FLT_MAX);
+        __m128i nearest = _mm_setzero_si128();
+        for(size_t cntr = 0; cntr < k; ++cntr)
+        {
+            __m128 d0 = _mm_sub_ps(x0, _mm_set1_ps(centers[cntr * 3 + 0]));
+            __m128 d1 = _mm_sub_ps(x1, _mm_set1_ps(centers[cntr * 3 + 1]));
+            __m128 d2 = _mm_sub_ps(x2, _mm_set1_ps(centers[cntr * 3 + 2]));
+            __m128 dist = _mm_add_ps(_mm_add_ps(_mm_mul_ps(d0, d0), _mm_mul_ps(d1, d1)),
+                                     _mm_mul_ps(d2, d2));
+            __m128 closer = _mm_cmplt_ps(dist, min_dist);
+            min_dist = _mm_blendv_ps(min_dist, dist, closer);
+            nearest = _mm_blendv_epi8(nearest, _mm_set1_epi32(int32_t(cntr)),
+                                      _mm_castps_si128(closer));
+        }
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(labels + (bin - begin)), nearest);
+    }
+    nearest_centers<3>(component, bin, end, centers, k, labels + (bin - begin));
+}
+
+Kernel select_kernel()
+{
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("avx2"))
+    {
+        return nearest_centers_avx2;
+    }
+    if(__builtin_cpu_supports("sse4.1"))
+    {
+        return nearest_centers_sse41;
+    }
+    return nearest_centers<3>;
+}
+}
+#endif
+
+void nearest_centers_3(const unsigned char *const *component, size_t begin, size_t end,
+                       const float *centers, size_t k, uint32_t *labels)
+{
+#ifdef DISTANCE_KERNELS_X86
+    static const Kernel kernel = select_kernel();
+    kernel(component, begin, end, centers, k, labels);
+#else
+    nearest_centers<3>(component, begin, end, centers, k, labels);
+#endif
+}
@@ -0,0 +1,42 @@
+#pragma once
+
+#include <cfloat>
+#include <cstddef>
+#include <cstdint>
+
+// Nearest center search for bins with 8-bit components, stored as one array
+// per component as in FlatHistogram. centers holds k keys of N components
+// each, back to back. labels[i] receives the nearest center of bin
+// begin + i. Squared distances are computed in single precision, in the
+// same order by every variant, and ties go to the lower center index.
+template <size_t N>
+void nearest_centers(const unsigned char *const *component, size_t begin, size_t end,
+                     const float *centers, size_t k, uint32_t *labels)
+{
+    for(size_t bin = begin; bin < end; ++bin)
+    {
+        float min_dist = FLT_MAX;
+        uint32_t nearest = 0;
+        for(size_t cntr = 0; cntr < k; ++cntr)
+        {
+            float dist = 0.f;
+            for(size_t i = 0; i < N; ++i)
+            {
+                float d = float(component[i][bin]) - centers[cntr * N + i];
+                dist += d * d;
+            }
+            if(dist < min_dist)
+            {
+                min_dist = dist;
+                nearest = uint32_t(cntr);
+            }
+        }
+        labels[bin - begin] = nearest;
+    }
+}
+
+// Three component version. Blocks of bins are compared against all centers
+// at once with AVX2 or SSE4.1, whichever the CPU supports, picked on the
+// first call; other CPUs and non-x86 builds use nearest_centers<3>.
+void nearest_centers_3(const unsigned char *const *component, size_t begin, size_t end,
+                       const float *centers, size_t k, uint32_t *labels);
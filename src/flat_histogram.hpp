@@ -0,0 +1,75 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include "key.hpp"
+
+// Heap array of a trivial type whose storage starts on an ALIGNMENT byte
+// boundary. The length is padded up to a whole number of ALIGNMENT byte
+// lines and the padding is zeroed, so vector code may load full lines
+// past size().
+template <typename T>
+class AlignedArray
+{
+    std::unique_ptr<unsigned char[]> storage;
+    T *body;
+    size_t _size;
+
+   public:
+    static const size_t ALIGNMENT = 64;
+
+    AlignedArray() : body(NULL), _size(0) {}
+    explicit AlignedArray(size_t size) : _size(size)
+    {
+        const size_t bytes = (size * sizeof(T) + ALIGNMENT - 1) / ALIGNMENT * ALIGNMENT;
+        storage.reset(new unsigned char[bytes + ALIGNMENT]);
+        uintptr_t p = reinterpret_cast<uintptr_t>(storage.get());
+        body = reinterpret_cast<T *>((p + ALIGNMENT - 1) / ALIGNMENT * ALIGNMENT);
+        memset(body, 0, bytes);
+    }
+
+    size_t size() const { return _size; }
+    T *data() { return body; }
+    const T *data() const { return body; }
+    T &operator[](size_t index) { return body[index]; }
+    T operator[](size_t index) const { return body[index]; }
+};
+
+// Read-only snapshot of a histogram for the clustering loops.
+// Keys are stored as one contiguous array per component (structure of
+// arrays) next to an array of counts; bin i is the i-th element of each.
+template <size_t N, typename T>
+class FlatHistogram
+{
+    size_t _size;
+    AlignedArray<T> components[N];
+    AlignedArray<double> weights;
+
+   public:
+    FlatHistogram() : _size(0) {}
+    explicit FlatHistogram(size_t size) : _size(size), weights(size)
+    {
+        for(size_t i = 0; i < N; ++i)
+        {
+            components[i] = AlignedArray<T>(size);
+        }
+    }
+
+    size_t size() const { return _size; }
+    T *component(size_t i) { return components[i].data(); }
+    const T *component(size_t i) const { return components[i].data(); }
+    double *counts() { return weights.data(); }
+    const double *counts() const { return weights.data(); }
+
+    Key<N, T> key(size_t index) const
+    {
+        Key<N, T> result;
+        for(size_t i = 0; i < N; ++i)
+        {
+            result[i] = components[i][index];
+        }
+        return result;
+    }
+    double count(size_t index) const { return weights[index]; }
+};
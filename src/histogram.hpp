@@ -1,135 +1,48 @@
 #pragma once
 
+#include <assert.h>
 #include <algorithm>
 #include <cstdint>
 #include <iostream>
+#include <mutex>
 #include <vector>
+#include "flat_histogram.hpp"
+#include "key.hpp"
+#include "radix_sort.hpp"
 
 #define BITS 16
 #define BLOCKSIZE (1 << BITS)
 #define MASK (BLOCKSIZE - 1)
 
-template <size_t N, typename T>
-class Key
-{
-    T *body;
-
-   public:
-    Key() { body = new T[N]; }
-    Key(T *p)
-    {
-        body = new T[N];
-        for(size_t i = 0; i < N; ++i)
-        {
-            body[i] = p[i];
-        }
-    }
-    Key(const Key &other)
-    {
-        body = new T[N];
-        for(size_t i = 0; i < N; ++i)
-        {
-            body[i] = other.body[i];
-        }
-    }
-    ~Key() { delete[] body; }
-    Key &operator=(const Key &other)
-    {
-        for(size_t i = 0; i < N; ++i)
-        {
-            body[i] = other.body[i];
-        }
-        return *this;
-    }
-    T &operator[](size_t index) { return body[index]; }
-    T operator[](size_t index) const { return body[index]; }
-    bool operator==(const Key &other) const
-    {
-        for(size_t i = 0; i < N; ++i)
-        {
-            if(body[i] != other.body[i])
-            {
-                return false;
-            }
-        }
-        return true;
-    }
-    bool operator!=(const Key &other) const
-    {
-        for(size_t i = 0; i < N; ++i)
-        {
-            if(body[i] != other.body[i])
-            {
-                return true;
-            }
-        }
-        return false;
-    }
-    bool operator<(const Key &other) const
-    {
-        for(size_t i = 0; i < N; ++i)
-        {
-            if(body[i] != other.body[i])
-            {
-                return body[i] < other.body[i];
-            }
-        }
-        return false;
-    }
-    bool operator>(const Key &other) const
-    {
-        for(size_t i = 0; i < N; ++i)
-        {
-            if(body[i] != other.body[i])
-            {
-                return body[i] > other.body[i];
-            }
-        }
-        return false;
-    }
-
-    friend std::ostream &operator<<(std::ostream &str, const Key &key)
-    {
-        str << '(' << int(key[0]);
-        for(size_t i = 1; i < N; ++i)
-        {
-            str << ", " << int(key[i]);
-        }
-        str << ")";
-        return str;
-    }
-};
-
-template <size_t N, typename T>
+// Histogram bin. Tree links are 32-bit bin indices rather than pointers,
+// and the fields are ordered so that a 24-bit color with a uint32_t count
+// takes 20 bytes. C is the count type: uint32_t for pixel counts,
+// float or double for weighted histograms.
+template <size_t N, typename T, typename C = double>
 struct Node
 {
+    static const uint32_t NIL = 0xFFFFFFFF;
+
     Key<N, T> key;
-    double count;
+    uint8_t height;
     // Tree
-    Node *parent;
-    Node *left;
-    Node *right;
-    // List
-    Node *next;
+    uint32_t parent;
+    uint32_t left;
+    uint32_t right;
+    C count;
 
-    Node()
-    {
-        count = 0.;
-        parent = NULL;
-        left = NULL;
-        right = NULL;
-        next = NULL;
-    }
+    Node() : height(1), parent(NIL), left(NIL), right(NIL), count(0) {}
 };
 
-template <size_t N, typename T>
-class NodeIterator : public std::iterator<std::random_access_iterator_tag, Node<N, T>>
+
+template <size_t N, typename T, typename C = double>
+class NodeIterator : public std::iterator<std::random_access_iterator_tag, Node<N, T, C>>
 {
-    Node<N, T> **body;
+    Node<N, T, C> **body;
     size_t ind;
 
    public:
-    NodeIterator(Node<N, T> **_body, size_t _ind = 0) : body(_body), ind(_ind) {}
+    NodeIterator(Node<N, T, C> **_body, size_t _ind = 0) : body(_body), ind(_ind) {}
     NodeIterator(const NodeIterator &rhs) : body(rhs.body), ind(rhs.ind) {}
     inline NodeIterator &operator+=(int rhs)
     {
@@ -141,9 +54,9 @@ class NodeIterator : public std::iterator<std::random_access_iterator_tag, Node<
         ind -= rhs;
         return *this;
     }
-    inline Node<N, T> &operator*() const { return body[ind >> BITS][ind & MASK]; }
-    inline Node<N, T> *operator->() const { return &(body[ind >> BITS][ind & MASK]); }
-    inline Node<N, T> &operator[](int rhs) const
+    inline Node<N, T, C> &operator*() const { return body[ind >> BITS][ind & MASK]; }
+    inline Node<N, T, C> *operator->() const { return &(body[ind >> BITS][ind & MASK]); }
+    inline Node<N, T, C> &operator[](int rhs) const
     {
         return body[(ind + rhs) >> BITS][(ind + rhs) & MASK];
     }
@@ -199,183 +112,597 @@ class NodeIterator : public std::iterator<std::random_access_iterator_tag, Node<
         str << it.body << ' ' << it.ind;
         return str;
     }
-    explicit operator Node<N, T> *() const { return &(body[ind >> BITS][ind & MASK]); }
+    explicit operator Node<N, T, C> *() const { return &(body[ind >> BITS][ind & MASK]); }
 };
 
-template <size_t N, typename T>
+// Pool of node blocks that can be shared by several histograms. Blocks
+// released by a destroyed histogram are handed to the next one instead of
+// going back to the heap. Thread safe; must outlive its histograms.
+template <size_t N, typename T, typename C = double>
+class NodeArena
+{
+    std::vector<Node<N, T, C> *> blocks;
+    std::mutex mutex;
+
+   public:
+    NodeArena() {}
+    NodeArena(const NodeArena &) = delete;
+    NodeArena &operator=(const NodeArena &) = delete;
+    ~NodeArena()
+    {
+        for(size_t i = 0; i < blocks.size(); ++i)
+        {
+            delete[] blocks[i];
+        }
+    }
+
+    // Returns a block of BLOCKSIZE nodes with unspecified contents.
+    Node<N, T, C> *acquire()
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        if(blocks.empty())
+        {
+            lock.unlock();
+            return new Node<N, T, C>[BLOCKSIZE];
+        }
+        Node<N, T, C> *block = blocks.back();
+        blocks.pop_back();
+        return block;
+    }
+    void release(Node<N, T, C> *block)
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        blocks.push_back(block);
+    }
+};
+
+template <unsigned Bits>
+class DenseHistogram;
+
+// Bin orders produced by Histogram::sort().
+enum SortOrder
+{
+    SORT_BY_COUNT,  // ascending count
+    SORT_BY_KEY,    // ascending key
+    SORT_NONE       // keep the current order
+};
+
+// Bins live in blocks of BLOCKSIZE nodes and are numbered 0 .. size() - 1
+// without gaps; get_new() hands out the first unused slot past the last
+// bin, allocating a new block when the last one is full. An AVL
+// tree over the bin indices finds bins by key while the histogram grows.
+template <size_t N, typename T, typename C = double>
 class Histogram
 {
-    Node<N, T> *free;
-    std::vector<Node<N, T> *> body;
-    Node<N, T> *head;
+    typedef Node<N, T, C> NodeType;
+    static const uint32_t NIL = NodeType::NIL;
+
+    std::vector<NodeType *> body;
+    uint32_t head;
     size_t _size;
+    // Static search index over the keys in Eytzinger (BFS) layout, 1-based.
+    // It is valid while 'indexed' is set, i.e. until a new key is inserted
+    // or the bins are reordered.
+    std::vector<Key<N, T> > index_keys;
+    std::vector<uint32_t> index_bins;
+    bool indexed;
+    NodeArena<N, T, C> *arena;
 
-    Node<N, T> *allocate();
-    Node<N, T> *get_new();
-    Node<N, T> &as_tree_at(const Key<N, T> key);
+    void allocate();
+    uint32_t get_new();
+    NodeType &node(uint32_t index) const { return body[index >> BITS][index & MASK]; }
+    NodeType &as_tree_at(const Key<N, T> &key);
+    // AVL tree maintenance
+    uint32_t *find_slot(const Key<N, T> &key, uint32_t &parent);
+    uint32_t *child_link(uint32_t parent, uint32_t child);
+    void attach(uint32_t *slot, uint32_t parent, uint32_t index);
+    int height(uint32_t index) const { return index == NIL ? 0 : node(index).height; }
+    void update_height(uint32_t index);
+    uint32_t rotate_left(uint32_t x);
+    uint32_t rotate_right(uint32_t x);
+    void rebalance(uint32_t index);
+    // Unlinks the bin from the tree and moves the last bin into its slot.
+    void erase(uint32_t index);
+    // Appends a bin without looking it up in the tree. Used by the bulk
+    // loaders, which append keys in ascending order and call build_index().
+    void append(C w, const Key<N, T> &key);
+    // Links a balanced tree and fills the search index from the bins listed
+    // in ascending key order.
+    void build_index(const std::vector<uint32_t> &order);
+    uint32_t link_sorted(const std::vector<uint32_t> &order, size_t lo, size_t hi,
+                         uint32_t parent);
+    size_t fill_index(const std::vector<uint32_t> &order, size_t rank, size_t k);
+    // Sort helpers: order[i] receives the current index of the bin that
+    // goes to position i, permute() then moves the nodes there.
+    void key_order(std::vector<uint32_t> &order, std::true_type) const;
+    void key_order(std::vector<uint32_t> &order, std::false_type) const;
+    void permute(const std::vector<uint32_t> &order);
+
+    template <unsigned Bits>
+    friend class DenseHistogram;
 
    public:
-    Histogram();
-    void add(double w, const Key<N, T> key);
-    void remove(const Key<N, T> key);
-    void sort();
+    static const size_t npos = size_t(-1);
+
+    // Node blocks come from arena when one is given, from the heap otherwise.
+    explicit Histogram(NodeArena<N, T, C> *arena = NULL);
+    Histogram(const Histogram &) = delete;
+    Histogram &operator=(const Histogram &) = delete;
+    ~Histogram();
+    // Empties the histogram but keeps its blocks for the bins to come.
+    void reset();
+    void add(C w, const Key<N, T> &key);
+    // Subtracts w from the bin of key; a bin whose count drops to zero is
+    // removed. Removing a bin moves the last bin into its index.
+    void remove(C w, const Key<N, T> &key);
+    // Removes the bin of key whatever its count.
+    void remove(const Key<N, T> &key);
+    // Adds every bin of other to this histogram.
+    void merge(const Histogram &other);
+    // Reorders the bins; the tree has to be rebuilt afterwards.
+    void sort(SortOrder order = SORT_BY_COUNT);
+    // Rebuilds the tree and the search index as balanced structures over the
+    // bins taken in key order.
     void rebuild_tree();
+    // Index of the bin holding key, or npos. Uses the search index, so it
+    // must be called after rebuild_tree() with no new keys added since.
+    size_t find(const Key<N, T> &key) const;
+    // Copies the bins, in their current order, into a structure-of-arrays
+    // snapshot for clustering.
+    FlatHistogram<N, T> freeze() const;
     size_t size() const { return _size; }
-    NodeIterator<N, T> begin() { return NodeIterator<N, T>(&(body[0]), 0); }
-    NodeIterator<N, T> end() { return NodeIterator<N, T>(&(body[0]), _size); }
-    Node<N, T> &operator[](size_t index) const;
+    NodeIterator<N, T, C> begin() { return NodeIterator<N, T, C>(&(body[0]), 0); }
+    NodeIterator<N, T, C> end() { return NodeIterator<N, T, C>(&(body[0]), _size); }
+    NodeType &operator[](size_t index) const { return node(uint32_t(index)); }
 };
 
-template <size_t N, typename T>
-Histogram<N, T>::Histogram()
+template <size_t N, typename T, typename C>
+Histogram<N, T, C>::Histogram(NodeArena<N, T, C> *arena) : arena(arena)
 {
-    free = allocate();
-    head = NULL;
+    allocate();
+    head = NIL;
     _size = 0;
+    indexed = false;
 }
 
-template <size_t N, typename T>
-Node<N, T> *Histogram<N, T>::allocate()
+template <size_t N, typename T, typename C>
+Histogram<N, T, C>::~Histogram()
 {
-    /* std::vector<Node<N, T>> __p(BLOCKSIZE);*/
-    Node<N, T> *__p = new Node<N, T>[BLOCKSIZE];
-    body.push_back(&(__p[0]));
-    for(size_t i = 0; i < BLOCKSIZE - 1; ++i)
+    for(size_t i = 0; i < body.size(); ++i)
     {
-        __p[i].next = &(__p[i + 1]);
+        if(arena != NULL)
+        {
+            arena->release(body[i]);
+        }
+        else
+        {
+            delete[] body[i];
+        }
     }
-    __p[BLOCKSIZE - 1].next = NULL;
-    return &(__p[0]);
 }
 
-template <size_t N, typename T>
-Node<N, T> *Histogram<N, T>::get_new()
+template <size_t N, typename T, typename C>
+void Histogram<N, T, C>::reset()
+{
+    head = NIL;
+    _size = 0;
+    index_keys.clear();
+    index_bins.clear();
+    indexed = false;
+}
+
+template <size_t N, typename T, typename C>
+void Histogram<N, T, C>::allocate()
+{
+    NodeType *__p = (arena != NULL) ? arena->acquire() : new NodeType[BLOCKSIZE];
+    body.push_back(&(__p[0]));
+}
+
+// Nodes are reinitialized when they are handed out, so slots returned by
+// reset() or erase() need no cleanup.
+template <size_t N, typename T, typename C>
+uint32_t Histogram<N, T, C>::get_new()
 {
-    if(free->next == NULL)
+    assert(_size < NIL);
+    if(_size == body.size() * BLOCKSIZE)
     {
-        free->next = allocate();
+        allocate();
     }
-    Node<N, T> *result = free;
-    free = free->next;
-    result->next = NULL;
-    ++_size;
+    uint32_t result = uint32_t(_size++);
+    node(result) = NodeType();
     return result;
 }
 
-template <size_t N, typename T>
-Node<N, T> &Histogram<N, T>::as_tree_at(const Key<N, T> key)
+template <size_t N, typename T, typename C>
+uint32_t *Histogram<N, T, C>::find_slot(const Key<N, T> &key, uint32_t &parent)
+{
+    parent = NIL;
+    uint32_t *slot = &head;
+    while(*slot != NIL && node(*slot).key != key)
+    {
+        parent = *slot;
+        NodeType &p = node(parent);
+        slot = (key < p.key) ? &(p.left) : &(p.right);
+    }
+    return slot;
+}
+
+// The link that points from parent (or the root pointer) to child.
+template <size_t N, typename T, typename C>
+uint32_t *Histogram<N, T, C>::child_link(uint32_t parent, uint32_t child)
+{
+    if(parent == NIL)
+    {
+        return &head;
+    }
+    NodeType &p = node(parent);
+    return (p.left == child) ? &(p.left) : &(p.right);
+}
+
+template <size_t N, typename T, typename C>
+void Histogram<N, T, C>::attach(uint32_t *slot, uint32_t parent, uint32_t index)
+{
+    *slot = index;
+    NodeType &p = node(index);
+    p.parent = parent;
+    p.left = NIL;
+    p.right = NIL;
+    p.height = 1;
+    rebalance(parent);
+}
+
+template <size_t N, typename T, typename C>
+void Histogram<N, T, C>::update_height(uint32_t index)
+{
+    NodeType &p = node(index);
+    p.height = uint8_t(1 + std::max(height(p.left), height(p.right)));
+}
+
+template <size_t N, typename T, typename C>
+uint32_t Histogram<N, T, C>::rotate_left(uint32_t x)
+{
+    NodeType &nx = node(x);
+    uint32_t y = nx.right;
+    NodeType &ny = node(y);
+    *child_link(nx.parent, x) = y;
+    nx.right = ny.left;
+    if(ny.left != NIL)
+    {
+        node(ny.left).parent = x;
+    }
+    ny.parent = nx.parent;
+    ny.left = x;
+    nx.parent = y;
+    update_height(x);
+    update_height(y);
+    return y;
+}
+
+template <size_t N, typename T, typename C>
+uint32_t Histogram<N, T, C>::rotate_right(uint32_t x)
 {
-    if(head == NULL)
+    NodeType &nx = node(x);
+    uint32_t y = nx.left;
+    NodeType &ny = node(y);
+    *child_link(nx.parent, x) = y;
+    nx.left = ny.right;
+    if(ny.right != NIL)
     {
-        head = get_new();
-        head->key = key;
-        return *head;
+        node(ny.right).parent = x;
     }
+    ny.parent = nx.parent;
+    ny.right = x;
+    nx.parent = y;
+    update_height(x);
+    update_height(y);
+    return y;
+}
 
-    Node<N, T> *p = head;
-    do
+// Restores the AVL invariant on the path from index to the root.
+template <size_t N, typename T, typename C>
+void Histogram<N, T, C>::rebalance(uint32_t index)
+{
+    while(index != NIL)
     {
-        if(key < p->key)
+        update_height(index);
+        const NodeType &p = node(index);
+        int balance = height(p.left) - height(p.right);
+        if(balance > 1)
         {
-            if(p->left != NULL)
+            if(height(node(p.left).left) < height(node(p.left).right))
             {
-                p = p->left;
-            }
-            else
-            {
-                Node<N, T> *result = get_new();
-                p->left = result;
-                result->parent = p;
-                result->key = key;
-                return *result;
+                rotate_left(p.left);
             }
+            index = rotate_right(index);
         }
-        else if(key > p->key)
+        else if(balance < -1)
         {
-            if(p->right != NULL)
-            {
-                p = p->right;
-            }
-            else
+            if(height(node(p.right).right) < height(node(p.right).left))
             {
-                Node<N, T> *result = get_new();
-                p->right = result;
-                result->parent = p;
-                result->key = key;
-                return *result;
+                rotate_right(p.right);
             }
+            index = rotate_left(index);
         }
-        else
+        index = node(index).parent;
+    }
+}
+
+template <size_t N, typename T, typename C>
+Node<N, T, C> &Histogram<N, T, C>::as_tree_at(const Key<N, T> &key)
+{
+    uint32_t parent;
+    uint32_t *slot = find_slot(key, parent);
+    if(*slot != NIL)
+    {
+        return node(*slot);
+    }
+    uint32_t result = get_new();
+    node(result).key = key;
+    attach(slot, parent, result);
+    indexed = false;
+    return node(result);
+}
+
+template <size_t N, typename T, typename C>
+void Histogram<N, T, C>::add(C w, const Key<N, T> &key)
+{
+    as_tree_at(key).count += w;
+}
+
+template <size_t N, typename T, typename C>
+void Histogram<N, T, C>::remove(C w, const Key<N, T> &key)
+{
+    uint32_t parent;
+    uint32_t index = *find_slot(key, parent);
+    if(index == NIL)
+    {
+        return;
+    }
+    NodeType &p = node(index);
+    // Compared before subtracting so unsigned counts cannot wrap around.
+    if(!(w < p.count))
+    {
+        erase(index);
+    }
+    else
+    {
+        p.count -= w;
+    }
+}
+
+template <size_t N, typename T, typename C>
+void Histogram<N, T, C>::remove(const Key<N, T> &key)
+{
+    uint32_t parent;
+    uint32_t index = *find_slot(key, parent);
+    if(index != NIL)
+    {
+        erase(index);
+    }
+}
+
+template <size_t N, typename T, typename C>
+void Histogram<N, T, C>::erase(uint32_t index)
+{
+    // A node with two children takes over the bin of its in-order
+    // successor, which has at most one child and is unlinked instead.
+    if(node(index).left != NIL && node(index).right != NIL)
+    {
+        uint32_t successor = node(index).right;
+        while(node(successor).left != NIL)
         {
-            return *p;
+            successor = node(successor).left;
         }
-    } while(true);
+        node(index).key = node(successor).key;
+        node(index).count = node(successor).count;
+        index = successor;
+    }
+
+    const NodeType &p = node(index);
+    uint32_t child = (p.left != NIL) ? p.left : p.right;
+    uint32_t parent = p.parent;
+    if(child != NIL)
+    {
+        node(child).parent = parent;
+    }
+    *child_link(parent, index) = child;
+    rebalance(parent);
+
+    // Keep the bins contiguous: the last bin moves into the freed slot,
+    // and the last slot joins the unused tail that get_new() takes from.
+    uint32_t last = uint32_t(_size - 1);
+    if(last != index)
+    {
+        NodeType &moved = node(index);
+        moved = node(last);
+        *child_link(moved.parent, last) = index;
+        if(moved.left != NIL)
+        {
+            node(moved.left).parent = index;
+        }
+        if(moved.right != NIL)
+        {
+            node(moved.right).parent = index;
+        }
+    }
+    --_size;
+    indexed = false;
 }
 
-template <size_t N, typename T>
-void Histogram<N, T>::add(double w, const Key<N, T> key)
+template <size_t N, typename T, typename C>
+void Histogram<N, T, C>::merge(const Histogram &other)
 {
-    as_tree_at(key).count += w;
+    for(size_t i = 0; i < other.size(); ++i)
+    {
+        const NodeType &p = other[i];
+        add(p.count, p.key);
+    }
+}
+
+template <size_t N, typename T, typename C>
+void Histogram<N, T, C>::append(C w, const Key<N, T> &key)
+{
+    NodeType &p = node(get_new());
+    p.key = key;
+    p.count = w;
 }
 
-template <size_t N, typename T>
-Node<N, T> &Histogram<N, T>::operator[](size_t index) const
+template <size_t N, typename T, typename C>
+void Histogram<N, T, C>::build_index(const std::vector<uint32_t> &order)
 {
-    return body[index >> BITS][index & MASK];
+    head = link_sorted(order, 0, order.size(), NIL);
+    index_keys.resize(order.size() + 1);
+    index_bins.resize(order.size() + 1);
+    fill_index(order, 0, 1);
+    indexed = true;
 }
 
-template <size_t N, typename T>
-void Histogram<N, T>::sort()
+template <size_t N, typename T, typename C>
+uint32_t Histogram<N, T, C>::link_sorted(const std::vector<uint32_t> &order, size_t lo,
+                                         size_t hi, uint32_t parent)
 {
-    std::sort(begin(), end(),
-              [](const Node<N, T> &n1, const Node<N, T> &n2) { return n1.count < n2.count; });
+    if(lo >= hi)
+    {
+        return NIL;
+    }
+    size_t mid = lo + (hi - lo) / 2;
+    uint32_t index = order[mid];
+    NodeType &p = node(index);
+    p.parent = parent;
+    p.left = link_sorted(order, lo, mid, index);
+    p.right = link_sorted(order, mid + 1, hi, index);
+    update_height(index);
+    return index;
 }
 
-template <size_t N, typename T>
-void Histogram<N, T>::rebuild_tree()
+// An in-order walk of the implicit tree (children of k are 2k and 2k + 1)
+// visits the slots in key order. Returns the next unused rank.
+template <size_t N, typename T, typename C>
+size_t Histogram<N, T, C>::fill_index(const std::vector<uint32_t> &order, size_t rank,
+                                      size_t k)
 {
-    head = &(body[0][0]);
-    head->parent = NULL;
-    head->left = NULL;
-    head->right = NULL;
-    NodeIterator<N, T> last(&(body[0]), size());
-    for(NodeIterator<N, T> it(&(body[0]), 1); it != last; ++it)
+    if(k < index_keys.size())
     {
-        it->left = NULL;
-        it->right = NULL;
-        Node<N, T> *p = head;
-        do
+        rank = fill_index(order, rank, 2 * k);
+        index_keys[k] = node(order[rank]).key;
+        index_bins[k] = order[rank];
+        rank = fill_index(order, rank + 1, 2 * k + 1);
+    }
+    return rank;
+}
+
+template <size_t N, typename T, typename C>
+size_t Histogram<N, T, C>::find(const Key<N, T> &key) const
+{
+    assert(indexed);
+    const size_t n = index_keys.size();
+    size_t k = 1;
+    while(k < n)
+    {
+        k = 2 * k + size_t(index_keys[k] < key);
+    }
+    // Drop the trailing right turns and the last left turn to get back to
+    // the smallest slot not less than key.
+    while(k & 1)
+    {
+        k >>= 1;
+    }
+    k >>= 1;
+    if(k == 0 || index_keys[k] != key)
+    {
+        return npos;
+    }
+    return index_bins[k];
+}
+
+template <size_t N, typename T, typename C>
+void Histogram<N, T, C>::sort(SortOrder order)
+{
+    if(order == SORT_NONE || size() < 2)
+    {
+        return;
+    }
+    std::vector<uint32_t> index(size());
+    if(order == SORT_BY_COUNT)
+    {
+        std::vector<uint64_t> keys(size());
+        for(size_t i = 0; i < size(); ++i)
         {
-            if(it->key < p->key)
-            {
-                if(p->left != NULL)
-                {
-                    p = p->left;
-                }
-                else
-                {
-                    p->left = (Node<N, T>*)it;
-                    it->parent = p;
-                    break;
-                }
-            }
-            else if(it->key > p->key)
-            {
-                if(p->right != NULL)
-                {
-                    p = p->right;
-                }
-                else
-                {
-                    p->right = (Node<N, T>*)it;
-                    it->parent = p;
-                    break;
-                }
-            }
-            else
-            {
-                break;
-            }
-        } while(true);
+            keys[i] = radix_key(node(uint32_t(i)).count);
+            index[i] = uint32_t(i);
+        }
+        radix_sort(keys, index);
+    }
+    else
+    {
+        key_order(index, std::integral_constant<bool, KeyPacking<N, T>::enabled>());
+    }
+    permute(index);
+    indexed = false;
+}
+
+template <size_t N, typename T, typename C>
+void Histogram<N, T, C>::key_order(std::vector<uint32_t> &order, std::true_type) const
+{
+    std::vector<uint64_t> keys(size());
+    for(size_t i = 0; i < size(); ++i)
+    {
+        keys[i] = node(uint32_t(i)).key.packed();
+        order[i] = uint32_t(i);
+    }
+    radix_sort(keys, order);
+}
+
+template <size_t N, typename T, typename C>
+void Histogram<N, T, C>::key_order(std::vector<uint32_t> &order, std::false_type) const
+{
+    for(size_t i = 0; i < size(); ++i)
+    {
+        order[i] = uint32_t(i);
     }
-}
\ No newline at end of file
+    const Histogram &self = *this;
+    std::stable_sort(order.begin(), order.end(),
+                     [&self](uint32_t a, uint32_t b) { return self[a].key < self[b].key; });
+}
+
+// Gathers the nodes in their new order into a scratch array and copies
+// them back. The reads are independent of each other, which keeps many
+// cache misses in flight, unlike following the permutation's cycles.
+template <size_t N, typename T, typename C>
+void Histogram<N, T, C>::permute(const std::vector<uint32_t> &order)
+{
+    std::vector<NodeType> sorted;
+    sorted.reserve(order.size());
+    for(size_t i = 0; i < order.size(); ++i)
+    {
+        sorted.push_back(node(order[i]));
+    }
+    for(size_t i = 0; i < order.size(); ++i)
+    {
+        node(uint32_t(i)) = sorted[i];
+    }
+}
+
+template <size_t N, typename T, typename C>
+void Histogram<N, T, C>::rebuild_tree()
+{
+    std::vector<uint32_t> order(size());
+    key_order(order, std::integral_constant<bool, KeyPacking<N, T>::enabled>());
+    build_index(order);
+}
+
+template <size_t N, typename T, typename C>
+FlatHistogram<N, T> Histogram<N, T, C>::freeze() const
+{
+    FlatHistogram<N, T> result(size());
+    for(size_t i = 0; i < size(); ++i)
+    {
+        const NodeType &p = node(uint32_t(i));
+        for(size_t c = 0; c < N; ++c)
+        {
+            result.component(c)[i] = p.key[c];
+        }
+        result.counts()[i] = double(p.count);
+    }
+    return result;
+}
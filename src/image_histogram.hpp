@@ -0,0 +1,210 @@
+#pragma once
+
+#include <assert.h>
+#include <algorithm>
+#include <memory>
+#include <vector>
+#include "dense_histogram.hpp"
+#include "histogram.hpp"
+#include "imageformats.hpp"
+#include "parallel.hpp"
+#include "quantization.hpp"
+
+// Color histograms of whole images.
+// The rows are split into bands, at most one per pool thread and at least
+// BAND_PIXELS pixels each. When every band has at least as many pixels as
+// the histogram has bins, every band is counted into a histogram of its own
+// and the partial histograms are merged at the end, so the counting itself
+// needs no synchronization. Otherwise a private table would cost more to
+// clear and merge than counting does, and the pixels are instead bucketed
+// by page: the bands sort their pixels by the level of the first component
+// into one shared buffer, then every page is counted by a single thread.
+// Pixels are quantized to Bits bits per component on the way in.
+
+const size_t BAND_PIXELS = 1 << 16;
+
+inline size_t histogram_bands(const ColorByteImage &image, ThreadPool &pool)
+{
+    const size_t pixels = size_t(image.Width()) * image.Height();
+    return std::max<size_t>(1, std::min(pool.size(), pixels / BAND_PIXELS));
+}
+
+template <unsigned Bits>
+void build_histogram(DenseHistogram<Bits> &hist, const ColorByteImage &image, ThreadPool &pool)
+{
+    typedef DenseHistogram<Bits> Dense;
+    typedef Quantizer<Bits> Quant;
+    const size_t bands = histogram_bands(image, pool);
+    const size_t pixels = size_t(image.Width()) * image.Height();
+    if(bands > 1 && pixels / bands < Dense::SIZE)
+    {
+        // Pixels per band and page
+        std::vector<size_t> offsets(bands * Dense::PAGES, 0);
+        pool.run(bands, [&](size_t band) {
+            size_t *count = &offsets[band * Dense::PAGES];
+            size_t begin, end;
+            split_range(image.Height(), bands, band, begin, end);
+            for(size_t j = begin; j < end; ++j)
+            {
+                const ColorBytePixel *row = image.Row(int(j));
+                for(int i = 0; i < image.Width(); ++i)
+                {
+                    ++count[Quant::level(row[i].r)];
+                }
+            }
+        });
+        // Page after page, the pixels of every band in band order
+        std::vector<size_t> starts(Dense::PAGES + 1, 0);
+        size_t total = 0;
+        for(size_t page = 0; page < Dense::PAGES; ++page)
+        {
+            starts[page] = total;
+            for(size_t band = 0; band < bands; ++band)
+            {
+                const size_t count = offsets[band * Dense::PAGES + page];
+                offsets[band * Dense::PAGES + page] = total;
+                total += count;
+            }
+        }
+        starts[Dense::PAGES] = total;
+
+        std::vector<uint16_t> entries(pixels);
+        pool.run(bands, [&](size_t band) {
+            size_t *cursor = &offsets[band * Dense::PAGES];
+            size_t begin, end;
+            split_range(image.Height(), bands, band, begin, end);
+            for(size_t j = begin; j < end; ++j)
+            {
+                const ColorBytePixel *row = image.Row(int(j));
+                for(int i = 0; i < image.Width(); ++i)
+                {
+                    entries[cursor[Quant::level(row[i].r)]++] = Dense::entry(row[i].g, row[i].b);
+                }
+            }
+        });
+        pool.run(Dense::PAGES, [&](size_t page) {
+            if(starts[page + 1] > starts[page])
+            {
+                hist.add_page(page, &entries[starts[page]], starts[page + 1] - starts[page]);
+            }
+        });
+        return;
+    }
+    std::vector<std::unique_ptr<DenseHistogram<Bits> > > parts(bands);
+    pool.run(bands, [&](size_t band) {
+        DenseHistogram<Bits> *part = &hist;
+        if(band != 0)
+        {
+            parts[band].reset(new DenseHistogram<Bits>());
+            part = parts[band].get();
+        }
+        size_t begin, end;
+        split_range(image.Height(), bands, band, begin, end);
+        for(size_t j = begin; j < end; ++j)
+        {
+            for(int i = 0; i < image.Width(); ++i)
+            {
+                const ColorBytePixel pixel = image(i, int(j));
+                part->add(pixel.r, pixel.g, pixel.b);
+            }
+        }
+    });
+    // Pages are independent, so the reduction runs in parallel over pages.
+    pool.run(DenseHistogram<Bits>::PAGES, [&](size_t page) {
+        for(size_t band = 1; band < bands; ++band)
+        {
+            hist.merge(*parts[band], page, page + 1);
+        }
+    });
+}
+
+template <unsigned Bits = 8, typename C>
+void build_histogram(Histogram<3, unsigned char, C> &hist, const ColorByteImage &image,
+                     ThreadPool &pool)
+{
+    typedef Quantizer<Bits> Quant;
+    const size_t bands = histogram_bands(image, pool);
+    std::vector<std::unique_ptr<Histogram<3, unsigned char, C> > > parts(bands);
+    pool.run(bands, [&](size_t band) {
+        Histogram<3, unsigned char, C> *part = &hist;
+        if(band != 0)
+        {
+            parts[band].reset(new Histogram<3, unsigned char, C>());
+            part = parts[band].get();
+        }
+        size_t begin, end;
+        split_range(image.Height(), bands, band, begin, end);
+        for(size_t j = begin; j < end; ++j)
+        {
+            for(int i = 0; i < image.Width(); ++i)
+            {
+                const ColorBytePixel pixel = image(i, int(j));
+                unsigned char _key[3] = {Quant::apply(pixel.r), Quant::apply(pixel.g),
+                                         Quant::apply(pixel.b)};
+                part->add(C(1), Key<3, unsigned char>(&(_key[0])));
+            }
+        }
+    });
+    for(size_t band = 1; band < bands; ++band)
+    {
+        hist.merge(*parts[band]);
+    }
+}
+
+// Frame-to-frame maintenance for video: moves only the pixels whose
+// quantized color differs between prev and cur from their old bin to the
+// new one, turning a histogram of prev into a histogram of cur. Bins that
+// become empty are removed. Returns the number of pixels moved.
+
+template <unsigned Bits>
+size_t update_histogram(DenseHistogram<Bits> &hist, const ColorByteImage &prev,
+                        const ColorByteImage &cur)
+{
+    typedef Quantizer<Bits> Quant;
+    assert(prev.Width() == cur.Width() && prev.Height() == cur.Height());
+    size_t changed = 0;
+    for(int j = 0; j < cur.Height(); ++j)
+    {
+        for(int i = 0; i < cur.Width(); ++i)
+        {
+            const ColorBytePixel p = prev(i, j);
+            const ColorBytePixel c = cur(i, j);
+            if(Quant::level(p.r) != Quant::level(c.r) || Quant::level(p.g) != Quant::level(c.g) ||
+               Quant::level(p.b) != Quant::level(c.b))
+            {
+                hist.remove(p.r, p.g, p.b);
+                hist.add(c.r, c.g, c.b);
+                ++changed;
+            }
+        }
+    }
+    return changed;
+}
+
+template <unsigned Bits = 8, typename C>
+size_t update_histogram(Histogram<3, unsigned char, C> &hist, const ColorByteImage &prev,
+                        const ColorByteImage &cur)
+{
+    typedef Quantizer<Bits> Quant;
+    assert(prev.Width() == cur.Width() && prev.Height() == cur.Height());
+    size_t changed = 0;
+    for(int j = 0; j < cur.Height(); ++j)
+    {
+        for(int i = 0; i < cur.Width(); ++i)
+        {
+            const ColorBytePixel p = prev(i, j);
+            const ColorBytePixel c = cur(i, j);
+            unsigned char _old[3] = {Quant::apply(p.r), Quant::apply(p.g), Quant::apply(p.b)};
+            unsigned char _new[3] = {Quant::apply(c.r), Quant::apply(c.g), Quant::apply(c.b)};
+            Key<3, unsigned char> old_key(&(_old[0]));
+            Key<3, unsigned char> new_key(&(_new[0]));
+            if(old_key != new_key)
+            {
+                hist.remove(C(1), old_key);
+                hist.add(C(1), new_key);
+                ++changed;
+            }
+        }
+    }
+    return changed;
+}
@@ -0,0 +1,77 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <fstream>
+#include "imageformats.hpp"
+#include "parallel.hpp"
+
+// Cluster index of every pixel, row after row like the image itself
+typedef ImageBase<uint16_t> LabelImage;
+
+// Pixel labeling of whole images.
+// The image is cut into tiles of TILE_WIDTH x TILE_HEIGHT pixels, small
+// enough for the source, result and label rows of a tile to stay in L2,
+// and the pool labels tiles concurrently. Tiles cover disjoint pixels, so
+// every thread writes straight into result and labels.
+
+const int LABEL_TILE_WIDTH = 256;
+const int LABEL_TILE_HEIGHT = 32;
+
+// labeler(r, g, b) returns the cluster of a color; result receives its
+// color from colors. labels, when not NULL, receives the cluster itself and
+// needs fewer than 2^16 clusters.
+template <typename Labeler>
+void label_image(const ColorByteImage &image, const Labeler &labeler,
+                 const ColorBytePixel *colors, ThreadPool &pool, ColorByteImage &result,
+                 LabelImage *labels = NULL)
+{
+    assert(result.Width() == image.Width() && result.Height() == image.Height());
+    assert(!labels || (labels->Width() == image.Width() && labels->Height() == image.Height()));
+    const int columns = (image.Width() + LABEL_TILE_WIDTH - 1) / LABEL_TILE_WIDTH;
+    const int rows = (image.Height() + LABEL_TILE_HEIGHT - 1) / LABEL_TILE_HEIGHT;
+    pool.run(size_t(columns) * rows, [&](size_t tile) {
+        const int x0 = int(tile % columns) * LABEL_TILE_WIDTH;
+        const int y0 = int(tile / columns) * LABEL_TILE_HEIGHT;
+        const int x1 = std::min(x0 + LABEL_TILE_WIDTH, image.Width());
+        const int y1 = std::min(y0 + LABEL_TILE_HEIGHT, image.Height());
+        for(int j = y0; j < y1; ++j)
+        {
+            const ColorBytePixel *in = image.Row(j);
+            ColorBytePixel *out = result.Row(j);
+            uint16_t *label_row = labels ? labels->Row(j) : NULL;
+            for(int i = x0; i < x1; ++i)
+            {
+                const uint32_t label = labeler(in[i].r, in[i].g, in[i].b);
+                out[i] = colors[label];
+                if(label_row)
+                {
+                    label_row[i] = uint16_t(label);
+                }
+            }
+        }
+    });
+}
+
+// Writes labels as a 16-bit binary PGM, one gray level per cluster.
+// Returns false if the file cannot be written.
+inline bool save_labels(const char *path, const LabelImage &labels)
+{
+    std::ofstream out(path, std::ios::binary);
+    if(!out)
+    {
+        return false;
+    }
+    out << "P5\n" << labels.Width() << " " << labels.Height() << "\n65535\n";
+    for(int j = 0; j < labels.Height(); ++j)
+    {
+        const uint16_t *row = labels.Row(j);
+        for(int i = 0; i < labels.Width(); ++i)
+        {
+            // PGM samples are big-endian
+            const char sample[2] = {char(row[i] >> 8), char(row[i] & 0xFF)};
+            out.write(sample, 2);
+        }
+    }
+    return bool(out);
+}
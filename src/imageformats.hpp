@@ -103,6 +103,11 @@ class ImageBase
 
     inline int Width() const { return width; }
     inline int Height() const { return height; }
+    // Pixels are stored row after row without padding
+    inline PixelType* Data() { return rawdata.get(); }
+    inline const PixelType* Data() const { return rawdata.get(); }
+    inline PixelType* Row( int y ) { return rawdata.get() + y * width; }
+    inline const PixelType* Row( int y ) const { return rawdata.get() + y * width; }
     inline ImageBase<PixelType> Copy() const
     {
         ImageBase<PixelType> res( width, height );
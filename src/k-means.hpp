@@ -1,11 +1,16 @@
 #pragma once
 
+#include <assert.h>
+#include <algorithm>
 #include <chrono>
 #include <cmath>
+#include <fstream>
+#include <limits>
 #include <random>
-#include <set>
 #include <vector>
+#include "distance_kernels.hpp"
 #include "histogram.hpp"
+#include "parallel.hpp"
 
 namespace KMeans {
 
@@ -18,71 +23,947 @@ double distance(const Key<N, T>& k1, const Key<N, T>& k2) {
     return sum;
 }
 
+// Bin access shared by the iteration variants that work on either
+// histogram representation.
+template <size_t N, typename T, typename C>
+inline double bin_key(const Histogram<N, T, C>& hist, size_t bin, double* key) {
+    for(size_t i = 0; i < N; ++i) {
+        key[i] = double(hist[bin].key[i]);
+    }
+    return double(hist[bin].count);
+}
+
 template <size_t N, typename T>
-std::vector<Key<N, T> > InitClusterCenters(const size_t num_of_clusters,
-                                           const Histogram<N, T>& hist) {
-    // const int seed = 42;
-    // std::mt19937 generator(seed);
+inline double bin_key(const FlatHistogram<N, T>& hist, size_t bin, double* key) {
+    for(size_t i = 0; i < N; ++i) {
+        key[i] = double(hist.component(i)[bin]);
+    }
+    return hist.count(bin);
+}
 
-    std::vector<Key<N, T> > result;
-    for(size_t i = 0; i < num_of_clusters; ++i) {
-        result.push_back(hist[i * 10].key);
+template <size_t N, typename T>
+inline double distance(const double* key, const Key<N, T>& center) {
+    double sum = 0.;
+    for(size_t i = 0; i < N; ++i) {
+        double d = key[i] - double(center[i]);
+        sum += d * d;
+    }
+    return sum;
+}
+
+// Uniform double in [0, 1) made from the top 53 bits of one draw. Unlike
+// std::uniform_real_distribution this gives the same sequence with every
+// standard library, so a seed always reproduces the same centers.
+inline double uniform(std::mt19937_64& generator) {
+    return double(generator() >> 11) * (1. / 9007199254740992.);
+}
+
+// Index of the bin whose cumulative weight first exceeds target.
+inline size_t sample_bin(const std::vector<double>& weights, double target) {
+    double cumulative = 0.;
+    for(size_t bin = 0; bin < weights.size(); ++bin) {
+        cumulative += weights[bin];
+        if(target < cumulative) {
+            return bin;
+        }
+    }
+    return weights.size() - 1;
+}
+
+// Weighted k-means++ seeding. Every new center is drawn with probability
+// proportional to count times squared distance to the nearest center
+// chosen so far. With trials > 1 each step draws that many candidates and
+// keeps the one that lowers the total potential most (greedy k-means++).
+template <size_t N, typename Hist>
+std::vector<Key<N, double> > seed_plus_plus(const size_t num_of_clusters,
+                                            const Hist& hist,
+                                            const uint64_t seed,
+                                            const size_t trials) {
+    std::vector<Key<N, double> > result;
+    if(num_of_clusters == 0) {
+        return result;
+    }
+    assert(hist.size() > 0);
+    std::mt19937_64 generator(seed);
+    const size_t size = hist.size();
+    std::vector<double> keys(size * N);
+    std::vector<double> counts(size);
+    double total = 0.;
+    for(size_t bin = 0; bin < size; ++bin) {
+        counts[bin] = bin_key(hist, bin, &keys[bin * N]);
+        total += counts[bin];
+    }
+
+    std::vector<double> nearest(size, std::numeric_limits<double>::infinity());
+    std::vector<double> potential(size);
+    size_t chosen = sample_bin(counts, uniform(generator) * total);
+    while(true) {
+        Key<N, double> center(&keys[chosen * N]);
+        result.push_back(center);
+        if(result.size() == num_of_clusters) {
+            break;
+        }
+
+        double sum = 0.;
+        for(size_t bin = 0; bin < size; ++bin) {
+            nearest[bin] = std::min(nearest[bin], distance(&keys[bin * N], center));
+            potential[bin] = counts[bin] * nearest[bin];
+            sum += potential[bin];
+        }
+
+        chosen = sample_bin(potential, uniform(generator) * sum);
+        if(trials > 1) {
+            // Total potential after adding bin candidate as a center
+            auto potential_with = [&](size_t candidate) {
+                double candidate_sum = 0.;
+                for(size_t bin = 0; bin < size; ++bin) {
+                    double dist = 0.;
+                    for(size_t i = 0; i < N; ++i) {
+                        double d = keys[bin * N + i] - keys[candidate * N + i];
+                        dist += d * d;
+                    }
+                    candidate_sum += counts[bin] * std::min(nearest[bin], dist);
+                }
+                return candidate_sum;
+            };
+            double best_sum = potential_with(chosen);
+            for(size_t trial = 1; trial < trials; ++trial) {
+                const size_t candidate = sample_bin(potential, uniform(generator) * sum);
+                const double candidate_sum = potential_with(candidate);
+                if(candidate_sum < best_sum) {
+                    best_sum = candidate_sum;
+                    chosen = candidate;
+                }
+            }
+        }
     }
     return result;
 }
 
+template <size_t N, typename T, typename C>
+std::vector<Key<N, double> > InitClusterCenters(const size_t num_of_clusters,
+                                                const Histogram<N, T, C>& hist,
+                                                const uint64_t seed = 42,
+                                                const size_t trials = 1) {
+    return seed_plus_plus<N>(num_of_clusters, hist, seed, trials);
+}
+
 template <size_t N, typename T>
-Key<N, T> center_of_mass(const Histogram<N, T>& hist, const std::set<size_t>& cluster) {
-    Key<N, double> result_d;
+std::vector<Key<N, double> > InitClusterCenters(const size_t num_of_clusters,
+                                                const FlatHistogram<N, T>& hist,
+                                                const uint64_t seed = 42,
+                                                const size_t trials = 1) {
+    return seed_plus_plus<N>(num_of_clusters, hist, seed, trials);
+}
+
+// Per-cluster weighted sums of the bins assigned so far, and the number of
+// bins whose label changed.
+template <size_t N>
+struct ClusterSums {
+    std::vector<double> sum;
+    // Weighted sum of the squared norms of the keys
+    std::vector<double> square;
+    std::vector<double> weight;
+    size_t changed;
+
+    explicit ClusterSums(size_t num_of_clusters)
+        : sum(num_of_clusters * N, 0.),
+          square(num_of_clusters, 0.),
+          weight(num_of_clusters, 0.),
+          changed(0) {}
+
+    template <typename T>
+    void add(size_t cluster, const T* key, double w) {
+        double norm = 0.;
+        for(size_t i = 0; i < N; ++i) {
+            sum[cluster * N + i] += double(key[i]) * w;
+            norm += double(key[i]) * double(key[i]);
+        }
+        square[cluster] += norm * w;
+        weight[cluster] += w;
+    }
+
+    void add(const ClusterSums& other) {
+        for(size_t i = 0; i < sum.size(); ++i) {
+            sum[i] += other.sum[i];
+        }
+        for(size_t i = 0; i < weight.size(); ++i) {
+            square[i] += other.square[i];
+            weight[i] += other.weight[i];
+        }
+        changed += other.changed;
+    }
+};
+
+enum Algorithm { LLOYD, HAMERLY, MINI_BATCH };
+
+// Label of a bin that has not been assigned yet.
+const uint32_t UNASSIGNED = 0xFFFFFFFF;
+
+// Outcome of one iteration.
+struct IterationResult {
+    // Summed squared movement of the centers
+    double shift;
+    // Weighted squared distance of the bins to the centers they were
+    // assigned to, before those centers moved
+    double inertia;
+    // Bins whose label changed
+    size_t changed;
+};
+
+// Weighted squared distance of the bins of cluster cntr to center,
+// computed from the cluster sums alone.
+template <size_t N>
+double cluster_inertia(const ClusterSums<N>& sums, size_t cntr, const Key<N, double>& center) {
+    double cross = 0.;
+    double norm = 0.;
     for(size_t i = 0; i < N; ++i) {
-        result_d[i] = 0.;
+        cross += center[i] * sums.sum[cntr * N + i];
+        norm += center[i] * center[i];
     }
-    double sum = 0.;
-    for(auto pixel = cluster.begin(); pixel != cluster.end(); ++pixel) {
-        double w = hist[*pixel].count;
+    return std::max(sums.square[cntr] - 2. * cross + sums.weight[cntr] * norm, 0.);
+}
+
+template <size_t N>
+double inertia(const ClusterSums<N>& sums, const std::vector<Key<N, double> >& centers) {
+    double result = 0.;
+    for(size_t cntr = 0; cntr < centers.size(); ++cntr) {
+        result += cluster_inertia(sums, cntr, centers[cntr]);
+    }
+    return result;
+}
+
+// Moves every center to the center of mass of its cluster. A cluster with
+// no bins keeps its center.
+template <size_t N>
+IterationResult update_centers(const ClusterSums<N>& sums, std::vector<Key<N, double> >& centers) {
+    IterationResult result;
+    result.inertia = inertia(sums, centers);
+    result.changed = sums.changed;
+    result.shift = 0.;
+    for(size_t cntr = 0; cntr < centers.size(); ++cntr) {
+        if(sums.weight[cntr] == 0.) {
+            continue;
+        }
+        Key<N, double> new_center;
         for(size_t i = 0; i < N; ++i) {
-            result_d[i] += double(hist[*pixel].key[i]) * w;
+            new_center[i] = sums.sum[cntr * N + i] / sums.weight[cntr];
         }
-        sum += w;
+        result.shift += distance(new_center, centers[cntr]);
+        centers[cntr] = new_center;
     }
-    for(size_t i = 0; i < N; ++i) {
-        result_d[i] /= sum;
+    return result;
+}
+
+// Stopping rule for the iteration loop: stop once the inertia improves by
+// less than tolerance relative to the previous iteration, once at most
+// max_changed bins change label, or after max_iterations iterations.
+// Iterations count from 1, so max_iterations of 1 runs a single iteration.
+struct Convergence {
+    double tolerance;
+    size_t max_changed;
+    size_t max_iterations;
+
+    Convergence() : tolerance(1e-4), max_changed(0), max_iterations(100) {}
+
+    bool done(const IterationResult& result, double previous_inertia, size_t iteration) const {
+        if(result.changed <= max_changed || iteration >= max_iterations) {
+            return true;
+        }
+        if(std::isinf(previous_inertia)) {
+            return false;
+        }
+        return previous_inertia - result.inertia <= tolerance * previous_inertia;
+    }
+};
+
+// Assigns bins [begin, end) to their nearest centers and adds them to sums.
+template <size_t N, typename Hist>
+void assign_range(const Hist& hist,
+                  const std::vector<Key<N, double> >& centers,
+                  std::vector<uint32_t>& labels,
+                  size_t begin, size_t end,
+                  ClusterSums<N>& sums) {
+    const size_t num_of_clusters = centers.size();
+    for(size_t color = begin; color < end; ++color) {
+        double key[N];
+        const double w = bin_key(hist, color, key);
+        double min_dist = 0.;
+        size_t nearest_cntr = 0;
+        for(size_t cntr = 0; cntr < num_of_clusters; ++cntr) {
+            double dist = distance(key, centers[cntr]);
+            if(cntr == 0 || dist < min_dist) {
+                min_dist = dist;
+                nearest_cntr = cntr;
+            }
+        }
+
+        if(labels[color] != nearest_cntr) {
+            labels[color] = uint32_t(nearest_cntr);
+            ++sums.changed;
+        }
+        sums.add(nearest_cntr, key, w);
     }
-    Key<N, T> result;
+}
+
+// 8-bit keys go through the single precision kernels of
+// distance_kernels.hpp.
+template <size_t N>
+void assign_range(const FlatHistogram<N, unsigned char>& hist,
+                  const std::vector<Key<N, double> >& centers,
+                  std::vector<uint32_t>& labels,
+                  size_t begin, size_t end,
+                  ClusterSums<N>& sums) {
+    const unsigned char* component[N];
     for(size_t i = 0; i < N; ++i) {
-        result[i] = T(result_d[i]);
+        component[i] = hist.component(i);
+    }
+    std::vector<float> packed(centers.size() * N);
+    for(size_t cntr = 0; cntr < centers.size(); ++cntr) {
+        for(size_t i = 0; i < N; ++i) {
+            packed[cntr * N + i] = float(centers[cntr][i]);
+        }
+    }
+    std::vector<uint32_t> nearest(end - begin);
+    if(N == 3) {
+        nearest_centers_3(component, begin, end, packed.data(), centers.size(), nearest.data());
+    } else {
+        nearest_centers<N>(component, begin, end, packed.data(), centers.size(), nearest.data());
+    }
+
+    const double* counts = hist.counts();
+    for(size_t color = begin; color < end; ++color) {
+        unsigned char key[N];
+        for(size_t i = 0; i < N; ++i) {
+            key[i] = component[i][color];
+        }
+        const uint32_t nearest_cntr = nearest[color - begin];
+        if(labels[color] != nearest_cntr) {
+            labels[color] = nearest_cntr;
+            ++sums.changed;
+        }
+        sums.add(nearest_cntr, key, counts[color]);
+    }
+}
+
+// One Lloyd iteration. labels[bin] receives the index of the nearest center,
+// and the new centers are accumulated in the same sweep over the bins.
+template <size_t N, typename Hist>
+IterationResult KMeansIteration(const Hist& hist,
+                                std::vector<Key<N, double> >& centers,
+                                std::vector<uint32_t>& labels) {
+    labels.resize(hist.size(), UNASSIGNED);
+    ClusterSums<N> sums(centers.size());
+    assign_range(hist, centers, labels, 0, hist.size(), sums);
+    return update_centers(sums, centers);
+}
+
+// Bins per task of the parallel iteration.
+const size_t CHUNK = 1 << 14;
+
+// Parallel Lloyd iteration. Every chunk of CHUNK bins gets its own partial
+// sums, which are added up in chunk order afterwards. The chunking does not
+// depend on the number of threads, so neither do the results.
+template <size_t N, typename Hist>
+IterationResult KMeansIteration(const Hist& hist,
+                                std::vector<Key<N, double> >& centers,
+                                std::vector<uint32_t>& labels,
+                                ThreadPool& pool) {
+    const size_t size = hist.size();
+    const size_t chunks = (size + CHUNK - 1) / CHUNK;
+    labels.resize(size, UNASSIGNED);
+    std::vector<ClusterSums<N> > partial(chunks, ClusterSums<N>(centers.size()));
+    pool.run(chunks, [&](size_t chunk) {
+        assign_range(hist, centers, labels, chunk * CHUNK, std::min(size, (chunk + 1) * CHUNK),
+                     partial[chunk]);
+    });
+
+    ClusterSums<N> sums(centers.size());
+    for(size_t chunk = 0; chunk < chunks; ++chunk) {
+        sums.add(partial[chunk]);
+    }
+    return update_centers(sums, centers);
+}
+
+// Squared distances to the nearest and the second nearest center. Ties go
+// to the lower center index, as in KMeansIteration.
+template <size_t N>
+size_t nearest_two(const double* key, const std::vector<Key<N, double> >& centers,
+                   double& first, double& second) {
+    size_t nearest_cntr = 0;
+    first = std::numeric_limits<double>::infinity();
+    second = std::numeric_limits<double>::infinity();
+    for(size_t cntr = 0; cntr < centers.size(); ++cntr) {
+        double dist = distance(key, centers[cntr]);
+        if(dist < first) {
+            second = first;
+            first = dist;
+            nearest_cntr = cntr;
+        } else if(dist < second) {
+            second = dist;
+        }
+    }
+    return nearest_cntr;
+}
+
+// State kept between Hamerly iterations: for every bin an upper bound on the
+// distance to its assigned center and a lower bound on the distance to any
+// other center, plus the running cluster sums. Call reset() whenever the
+// histogram or the centers are replaced from outside.
+template <size_t N>
+struct HamerlyBounds {
+    std::vector<double> upper;
+    std::vector<double> lower;
+    ClusterSums<N> sums;
+    bool initialized;
+
+    HamerlyBounds() : sums(0), initialized(false) {}
+    void reset() { initialized = false; }
+};
+
+// One k-means iteration accelerated with Hamerly's bounds. A bin is only
+// compared against all centers when its bounds no longer prove that its
+// label is unchanged, and the cluster sums are updated only for bins that
+// move. Assignments and centers match those of the double precision
+// KMeansIteration.
+template <size_t N, typename Hist>
+IterationResult HamerlyIteration(const Hist& hist,
+                                 std::vector<Key<N, double> >& centers,
+                                 std::vector<uint32_t>& labels,
+                                 HamerlyBounds<N>& bounds) {
+    const size_t num_of_clusters = centers.size();
+    double key[N];
+    double first, second;
+    size_t changed = 0;
+    if(!bounds.initialized) {
+        labels.resize(hist.size(), UNASSIGNED);
+        bounds.upper.resize(hist.size());
+        bounds.lower.resize(hist.size());
+        bounds.sums = ClusterSums<N>(num_of_clusters);
+        for(size_t color = 0; color < hist.size(); ++color) {
+            double w = bin_key(hist, color, key);
+            size_t nearest_cntr = nearest_two(key, centers, first, second);
+            if(labels[color] != nearest_cntr) {
+                labels[color] = uint32_t(nearest_cntr);
+                ++changed;
+            }
+            bounds.upper[color] = std::sqrt(first);
+            bounds.lower[color] = std::sqrt(second);
+            bounds.sums.add(nearest_cntr, key, w);
+        }
+        bounds.initialized = true;
+    } else {
+        // Half the distance from every center to the nearest other one
+        std::vector<double> half(num_of_clusters, std::numeric_limits<double>::infinity());
+        for(size_t a = 0; a < num_of_clusters; ++a) {
+            for(size_t b = a + 1; b < num_of_clusters; ++b) {
+                double d = std::sqrt(distance(centers[a], centers[b])) / 2.;
+                half[a] = std::min(half[a], d);
+                half[b] = std::min(half[b], d);
+            }
+        }
+        for(size_t color = 0; color < hist.size(); ++color) {
+            const size_t assigned = labels[color];
+            const double bound = std::max(half[assigned], bounds.lower[color]);
+            if(bounds.upper[color] < bound) {
+                continue;
+            }
+            double w = bin_key(hist, color, key);
+            bounds.upper[color] = std::sqrt(distance(key, centers[assigned]));
+            if(bounds.upper[color] < bound) {
+                continue;
+            }
+            size_t nearest_cntr = nearest_two(key, centers, first, second);
+            bounds.upper[color] = std::sqrt(first);
+            bounds.lower[color] = std::sqrt(second);
+            if(nearest_cntr != assigned) {
+                bounds.sums.add(assigned, key, -w);
+                bounds.sums.add(nearest_cntr, key, w);
+                labels[color] = uint32_t(nearest_cntr);
+                ++changed;
+            }
+        }
+    }
+
+    const std::vector<Key<N, double> > old_centers = centers;
+    IterationResult result = update_centers(bounds.sums, centers);
+    result.changed = changed;
+
+    // Loosen the bounds by how far the centers moved
+    std::vector<double> moved(num_of_clusters);
+    size_t farthest = 0;
+    for(size_t cntr = 0; cntr < num_of_clusters; ++cntr) {
+        moved[cntr] = std::sqrt(distance(old_centers[cntr], centers[cntr]));
+        if(moved[cntr] > moved[farthest]) {
+            farthest = cntr;
+        }
+    }
+    double second_farthest = 0.;
+    for(size_t cntr = 0; cntr < num_of_clusters; ++cntr) {
+        if(cntr != farthest) {
+            second_farthest = std::max(second_farthest, moved[cntr]);
+        }
+    }
+    for(size_t color = 0; color < hist.size(); ++color) {
+        bounds.upper[color] += moved[labels[color]];
+        bounds.lower[color] -= labels[color] == farthest ? second_farthest : moved[farthest];
     }
     return result;
 }
 
+// Budget of a mini-batch run. A zero limit is no limit; the run stops at
+// whichever limit is reached first. With neither limit set it stops after
+// DEFAULT_ITERATIONS iterations.
+struct MiniBatchOptions {
+    static const size_t DEFAULT_ITERATIONS = 100;
+
+    size_t batch_size;
+    size_t max_iterations;
+    double max_seconds;
+    uint64_t seed;
+
+    MiniBatchOptions()
+        : batch_size(1024), max_iterations(DEFAULT_ITERATIONS), max_seconds(0.), seed(42) {}
+};
+
+// Mini-batch k-means (Sculley 2010). Every iteration draws batch_size bins
+// with probability proportional to their counts and moves each center
+// towards the bins drawn for it, with a learning rate of one over the
+// number of bins it has received so far. A final full sweep fills labels;
+// the result reports the inertia of the final centers and their shift from
+// the initial ones.
 template <size_t N, typename T>
-double KMeansIteration(const Histogram<N, T>& hist,
-                         std::vector<Key<N, T> >& centers,
-                         std::vector<std::set<size_t> >& clusters) {
+IterationResult MiniBatchKMeans(const FlatHistogram<N, T>& hist,
+                                std::vector<Key<N, double> >& centers,
+                                std::vector<uint32_t>& labels,
+                                const MiniBatchOptions& options) {
     const size_t num_of_clusters = centers.size();
-    clusters.clear();
-    clusters = std::vector<std::set<size_t> >(num_of_clusters, std::set<size_t>());
-    for(size_t color = 0; color < hist.size(); ++color) {
-        double min_dist = distance(hist[color].key, centers[0]);
-        size_t nearest_cntr = 0;
+    const size_t size = hist.size();
+    std::vector<double> cumulative(size);
+    double total = 0.;
+    for(size_t bin = 0; bin < size; ++bin) {
+        total += hist.count(bin);
+        cumulative[bin] = total;
+    }
 
-        for(size_t cntr = 1; cntr < num_of_clusters; ++cntr) {
-            double dist = distance(hist[color].key, centers[cntr]);
-            if(dist < min_dist) {
-                min_dist = dist;
-                nearest_cntr = cntr;
+    const std::vector<Key<N, double> > initial_centers = centers;
+    std::vector<double> seen(num_of_clusters, 0.);
+    std::vector<double> batch(options.batch_size * N);
+    std::vector<size_t> nearest(options.batch_size);
+    std::mt19937_64 generator(options.seed);
+
+    size_t max_iterations = options.max_iterations;
+    if(max_iterations == 0 && !(options.max_seconds > 0.)) {
+        max_iterations = MiniBatchOptions::DEFAULT_ITERATIONS;
+    }
+    const auto start_time = std::chrono::steady_clock::now();
+    size_t iteration = 0;
+    while(size > 0 && num_of_clusters > 0) {
+        if(max_iterations != 0 && iteration == max_iterations) {
+            break;
+        }
+        if(options.max_seconds > 0.) {
+            std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start_time;
+            if(elapsed.count() >= options.max_seconds) {
+                break;
             }
         }
+        ++iteration;
 
-        clusters[nearest_cntr].insert(color);
+        // Assign the whole batch against the centers it started with
+        for(size_t b = 0; b < options.batch_size; ++b) {
+            const double target = uniform(generator) * total;
+            size_t bin = std::upper_bound(cumulative.begin(), cumulative.end(), target) -
+                         cumulative.begin();
+            bin = std::min(bin, size - 1);
+            double* key = &batch[b * N];
+            bin_key(hist, bin, key);
+            double min_dist = std::numeric_limits<double>::infinity();
+            for(size_t cntr = 0; cntr < num_of_clusters; ++cntr) {
+                double dist = 0.;
+                for(size_t i = 0; i < N; ++i) {
+                    double d = key[i] - centers[cntr][i];
+                    dist += d * d;
+                }
+                if(dist < min_dist) {
+                    min_dist = dist;
+                    nearest[b] = cntr;
+                }
+            }
+        }
+        for(size_t b = 0; b < options.batch_size; ++b) {
+            const size_t cntr = nearest[b];
+            seen[cntr] += 1.;
+            const double rate = 1. / seen[cntr];
+            for(size_t i = 0; i < N; ++i) {
+                centers[cntr][i] += rate * (batch[b * N + i] - centers[cntr][i]);
+            }
+        }
     }
 
-    double sum_shift_centers = 0.;
+    labels.resize(size, UNASSIGNED);
+    ClusterSums<N> sums(num_of_clusters);
+    assign_range(hist, centers, labels, 0, size, sums);
+    IterationResult result;
+    result.inertia = inertia(sums, centers);
+    result.changed = sums.changed;
+    result.shift = 0.;
     for(size_t cntr = 0; cntr < num_of_clusters; ++cntr) {
-        Key<N, T> new_center = center_of_mass(hist, clusters[cntr]);
-        sum_shift_centers += distance(new_center, centers[cntr]);
-        centers[cntr] = new_center;
+        result.shift += distance(initial_centers[cntr], centers[cntr]);
+    }
+    return result;
+}
+
+template <size_t N, typename T, typename C>
+IterationResult MiniBatchKMeans(const Histogram<N, T, C>& hist,
+                                std::vector<Key<N, double> >& centers,
+                                std::vector<uint32_t>& labels,
+                                const MiniBatchOptions& options) {
+    return MiniBatchKMeans(hist.freeze(), centers, labels, options);
+}
+
+// Converged centers kept to seed the next clustering of a similar
+// histogram, e.g. the next frame of a video.
+template <size_t N>
+struct Model {
+    std::vector<Key<N, double> > centers;
+    // Inertia per unit of histogram weight
+    double inertia;
+
+    Model() : inertia(0.) {}
+};
+
+// Inertia per unit of weight of hist clustered around centers.
+template <size_t N, typename Hist>
+double MeanInertia(const Hist& hist, const std::vector<Key<N, double> >& centers) {
+    std::vector<uint32_t> labels(hist.size(), UNASSIGNED);
+    ClusterSums<N> sums(centers.size());
+    assign_range(hist, centers, labels, 0, hist.size(), sums);
+    double total = 0.;
+    for(size_t cntr = 0; cntr < centers.size(); ++cntr) {
+        total += sums.weight[cntr];
+    }
+    return total > 0. ? inertia(sums, centers) / total : 0.;
+}
+
+template <size_t N, typename Hist>
+Model<N> MakeModel(const Hist& hist, const std::vector<Key<N, double> >& centers) {
+    Model<N> model;
+    model.centers = centers;
+    model.inertia = MeanInertia(hist, centers);
+    return model;
+}
+
+// Initial centers for hist taken from model. When the model has a
+// different number of centers, or its centers fit hist worse than they
+// fit the histogram they came from by more than a factor of 1 + slack,
+// fresh k-means++ centers are returned instead. reused tells which
+// happened.
+template <size_t N, typename Hist>
+std::vector<Key<N, double> > WarmStartCenters(const Model<N>& model,
+                                              const size_t num_of_clusters,
+                                              const Hist& hist,
+                                              const uint64_t seed = 42,
+                                              const size_t trials = 1,
+                                              const double slack = 0.25,
+                                              bool* reused = NULL) {
+    bool reuse = model.centers.size() == num_of_clusters && hist.size() > 0 &&
+                 MeanInertia(hist, model.centers) <= model.inertia * (1. + slack);
+    if(reused) {
+        *reused = reuse;
+    }
+    return reuse ? model.centers : InitClusterCenters(num_of_clusters, hist, seed, trials);
+}
+
+// Centers file: a line with the number of centers, N and the mean inertia,
+// then one line of N coordinates per center.
+template <size_t N>
+bool SaveModel(const char* path, const Model<N>& model) {
+    std::ofstream file(path);
+    file.precision(17);
+    file << model.centers.size() << ' ' << N << ' ' << model.inertia << '\n';
+    for(size_t cntr = 0; cntr < model.centers.size(); ++cntr) {
+        for(size_t i = 0; i < N; ++i) {
+            file << (i ? " " : "") << model.centers[cntr][i];
+        }
+        file << '\n';
+    }
+    return bool(file);
+}
+
+// Reading rejects files with no centers or more than MAX_MODEL_CENTERS,
+// a negative or non-finite inertia, non-finite coordinates and anything
+// after the last center; model is left untouched then.
+const size_t MAX_MODEL_CENTERS = size_t(1) << 24;
+
+template <size_t N>
+bool LoadModel(const char* path, Model<N>& model) {
+    std::ifstream file(path);
+    size_t num_of_clusters = 0, dimensions = 0;
+    double mean_inertia = 0.;
+    if(!(file >> num_of_clusters >> dimensions >> mean_inertia) || dimensions != N ||
+       num_of_clusters == 0 || num_of_clusters > MAX_MODEL_CENTERS ||
+       !std::isfinite(mean_inertia) || mean_inertia < 0.) {
+        return false;
     }
-    return sum_shift_centers;
+    // Grows with the centers actually read, not with the count claimed
+    std::vector<Key<N, double> > centers;
+    for(size_t cntr = 0; cntr < num_of_clusters; ++cntr) {
+        Key<N, double> center;
+        for(size_t i = 0; i < N; ++i) {
+            if(!(file >> center[i]) || !std::isfinite(center[i])) {
+                return false;
+            }
+        }
+        centers.push_back(center);
+    }
+    if(!(file >> std::ws).eof()) {
+        return false;
+    }
+    model.centers.swap(centers);
+    model.inertia = mean_inertia;
+    return true;
+}
+
+// Splits the bins in two with a short 2-means run seeded k-means++ style.
+// Returns false when all bins have the same key.
+template <size_t N>
+bool bisect(const std::vector<double>& keys, const std::vector<double>& counts,
+            const std::vector<uint32_t>& bins, std::mt19937_64& generator,
+            Key<N, double>* halves, std::vector<uint32_t>* members, double* inertias) {
+    const size_t ITERATIONS = 10;
+    std::vector<double> weights(bins.size());
+    double total = 0.;
+    for(size_t b = 0; b < bins.size(); ++b) {
+        weights[b] = counts[bins[b]];
+        total += weights[b];
+    }
+    halves[0] = Key<N, double>(&keys[bins[sample_bin(weights, uniform(generator) * total)] * N]);
+    double potential = 0.;
+    for(size_t b = 0; b < bins.size(); ++b) {
+        weights[b] = counts[bins[b]] * distance(&keys[bins[b] * N], halves[0]);
+        potential += weights[b];
+    }
+    if(potential <= 0.) {
+        return false;
+    }
+    halves[1] = Key<N, double>(&keys[bins[sample_bin(weights, uniform(generator) * potential)] * N]);
+
+    std::vector<uint8_t> side(bins.size(), 2);
+    ClusterSums<N> sums(2);
+    for(size_t iteration = 0; iteration < ITERATIONS; ++iteration) {
+        sums = ClusterSums<N>(2);
+        for(size_t b = 0; b < bins.size(); ++b) {
+            const double* key = &keys[bins[b] * N];
+            const uint8_t nearest = distance(key, halves[1]) < distance(key, halves[0]) ? 1 : 0;
+            if(side[b] != nearest) {
+                side[b] = nearest;
+                ++sums.changed;
+            }
+            sums.add(nearest, key, counts[bins[b]]);
+        }
+        if(sums.changed == 0) {
+            break;
+        }
+        std::vector<Key<N, double> > pair(halves, halves + 2);
+        update_centers(sums, pair);
+        halves[0] = pair[0];
+        halves[1] = pair[1];
+    }
+    for(size_t half = 0; half < 2; ++half) {
+        members[half].clear();
+        inertias[half] = cluster_inertia(sums, half, halves[half]);
+    }
+    for(size_t b = 0; b < bins.size(); ++b) {
+        members[side[b]].push_back(bins[b]);
+    }
+    return true;
+}
+
+// Bisecting k-means: starting from a single cluster, the cluster with the
+// largest inertia is split in two until there are max_k clusters. Entry
+// k - 1 of the result holds the centers of the k cluster stage, which are
+// good seeds for a full run with k centers.
+template <size_t N, typename Hist>
+std::vector<std::vector<Key<N, double> > > BisectingSeeds(const Hist& hist,
+                                                          const size_t max_k,
+                                                          const uint64_t seed = 42) {
+    std::vector<std::vector<Key<N, double> > > result;
+    const size_t size = hist.size();
+    if(max_k == 0 || size == 0) {
+        return result;
+    }
+    std::mt19937_64 generator(seed);
+    std::vector<double> keys(size * N);
+    std::vector<double> counts(size);
+    ClusterSums<N> sums(1);
+    std::vector<std::vector<uint32_t> > members(1);
+    for(size_t bin = 0; bin < size; ++bin) {
+        counts[bin] = bin_key(hist, bin, &keys[bin * N]);
+        sums.add(0, &keys[bin * N], counts[bin]);
+        members[0].push_back(uint32_t(bin));
+    }
+    std::vector<Key<N, double> > centers(1);
+    for(size_t i = 0; i < N; ++i) {
+        centers[0][i] = sums.sum[i] / sums.weight[0];
+    }
+    std::vector<double> inertias(1, cluster_inertia(sums, 0, centers[0]));
+    result.push_back(centers);
+
+    while(centers.size() < max_k) {
+        const size_t worst = std::max_element(inertias.begin(), inertias.end()) - inertias.begin();
+        Key<N, double> halves[2];
+        std::vector<uint32_t> halves_members[2];
+        double halves_inertia[2];
+        if(inertias[worst] > 0. && bisect<N>(keys, counts, members[worst], generator, halves,
+                                             halves_members, halves_inertia)) {
+            centers[worst] = halves[0];
+            members[worst].swap(halves_members[0]);
+            inertias[worst] = halves_inertia[0];
+            centers.push_back(halves[1]);
+            members.push_back(std::vector<uint32_t>());
+            members.back().swap(halves_members[1]);
+            inertias.push_back(halves_inertia[1]);
+        } else {
+            // Fewer distinct keys than clusters
+            centers.push_back(centers[worst]);
+            members.push_back(std::vector<uint32_t>());
+            inertias.push_back(0.);
+            inertias[worst] = 0.;
+        }
+        result.push_back(centers);
+    }
+    return result;
+}
+
+// Centers and labels of a finished clustering run.
+template <size_t N>
+struct Clustering {
+    std::vector<Key<N, double> > centers;
+    std::vector<uint32_t> labels;
+    // Inertia of the last iteration
+    double inertia;
+    size_t iterations;
+
+    Clustering() : inertia(std::numeric_limits<double>::infinity()), iterations(0) {}
+};
+
+// Runs Lloyd iterations from clustering.centers until convergence says so,
+// or until the deadline passes after at least one iteration. Returns false
+// in the latter case.
+template <size_t N, typename Hist>
+bool Refine(const Hist& hist,
+            Clustering<N>& clustering,
+            const Convergence& convergence,
+            const std::chrono::steady_clock::time_point deadline =
+                std::chrono::steady_clock::time_point::max()) {
+    double previous_inertia = std::numeric_limits<double>::infinity();
+    bool done = false;
+    while(!done) {
+        ++clustering.iterations;
+        IterationResult result = KMeansIteration(hist, clustering.centers, clustering.labels);
+        done = convergence.done(result, previous_inertia, clustering.iterations);
+        previous_inertia = result.inertia;
+        clustering.inertia = result.inertia;
+        if(!done && std::chrono::steady_clock::now() >= deadline) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Clusters hist for every k in [min_k, max_k]. The seeds come from one
+// bisecting run, and the candidates are then refined with Lloyd
+// iterations concurrently, one per pool task.
+template <size_t N, typename Hist>
+std::vector<Clustering<N> > KSweep(const Hist& hist,
+                                   const size_t min_k,
+                                   const size_t max_k,
+                                   const Convergence& convergence,
+                                   ThreadPool& pool,
+                                   const uint64_t seed = 42) {
+    assert(min_k >= 1 && min_k <= max_k);
+    const std::vector<std::vector<Key<N, double> > > seeds = BisectingSeeds<N>(hist, max_k, seed);
+    std::vector<Clustering<N> > candidates(seeds.empty() ? 0 : max_k - min_k + 1);
+    pool.run(candidates.size(), [&](size_t c) {
+        candidates[c].centers = seeds[min_k + c - 1];
+        Refine(hist, candidates[c], convergence);
+    });
+    return candidates;
+}
+
+// Elbow of the inertia curve: the candidate that lies farthest below the
+// straight line from the first to the last candidate, with both k and
+// inertia scaled to [0, 1]. Two candidates have no elbow; the second wins
+// if it lowers the inertia of the first by more than min_drop of it.
+template <size_t N>
+size_t SelectK(const std::vector<Clustering<N> >& candidates, const double min_drop = 0.25) {
+    if(candidates.size() < 2) {
+        return 0;
+    }
+    const double first = candidates.front().inertia;
+    const double last = candidates.back().inertia;
+    if(!(first > last)) {
+        return 0;
+    }
+    if(candidates.size() == 2) {
+        return first - last > min_drop * first ? 1 : 0;
+    }
+    size_t best = 0;
+    double best_gap = 0.;
+    for(size_t c = 0; c < candidates.size(); ++c) {
+        const double x = double(c) / double(candidates.size() - 1);
+        const double y = (candidates[c].inertia - last) / (first - last);
+        if(1. - x - y > best_gap) {
+            best_gap = 1. - x - y;
+            best = c;
+        }
+    }
+    return best;
+}
+
+// Best of restarts k-means runs from independent k-means++ seeds, run
+// concurrently on the pool. Run r is seeded with seed + r, and the run with
+// the lowest inertia wins, the lower r on ties, so the result only depends
+// on the base seed. With max_seconds > 0 the whole search shares that wall
+// clock budget: runs not started by then are skipped and running ones stop
+// at their next iteration, which makes the result timing dependent. Run 0
+// always starts. completed receives the number of runs that converged.
+template <size_t N, typename Hist>
+Clustering<N> BestOfRestarts(const Hist& hist,
+                             const size_t num_of_clusters,
+                             const size_t restarts,
+                             const Convergence& convergence,
+                             ThreadPool& pool,
+                             const uint64_t seed = 42,
+                             const size_t trials = 1,
+                             const double max_seconds = 0.,
+                             size_t* completed = NULL) {
+    std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::time_point::max();
+    if(max_seconds > 0.) {
+        deadline = std::chrono::steady_clock::now() +
+                   std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+                       std::chrono::duration<double>(max_seconds));
+    }
+    std::vector<Clustering<N> > runs(std::max<size_t>(restarts, 1));
+    std::vector<char> converged(runs.size(), 0);
+    pool.run(runs.size(), [&](size_t r) {
+        if(r > 0 && std::chrono::steady_clock::now() >= deadline) {
+            return;
+        }
+        runs[r].centers = InitClusterCenters(num_of_clusters, hist, seed + r, trials);
+        converged[r] = Refine(hist, runs[r], convergence, deadline) ? 1 : 0;
+    });
+
+    size_t best = 0;
+    for(size_t r = 1; r < runs.size(); ++r) {
+        if(runs[r].iterations > 0 && runs[r].inertia < runs[best].inertia) {
+            best = r;
+        }
+    }
+    if(completed) {
+        *completed = std::count(converged.begin(), converged.end(), 1);
+    }
+    return runs[best];
+}
 }
-}
\ No newline at end of file
@@ -0,0 +1,91 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <iostream>
+#include <type_traits>
+
+// Keys whose components are unsigned integers and fit into 64 bits in total
+// are compared as a single packed integer instead of component by component.
+template <size_t N, typename T>
+struct KeyPacking
+{
+    static const bool enabled = std::is_integral<T>::value && std::is_unsigned<T>::value &&
+                                N * sizeof(T) <= sizeof(uint64_t);
+};
+
+template <size_t N, typename T>
+class Key
+{
+    T body[N];
+
+    typedef std::integral_constant<bool, KeyPacking<N, T>::enabled> packed_tag;
+
+    bool equal(const Key &other, std::true_type) const { return packed() == other.packed(); }
+    bool equal(const Key &other, std::false_type) const
+    {
+        for(size_t i = 0; i < N; ++i)
+        {
+            if(body[i] != other.body[i])
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+    bool less(const Key &other, std::true_type) const { return packed() < other.packed(); }
+    bool less(const Key &other, std::false_type) const
+    {
+        for(size_t i = 0; i < N; ++i)
+        {
+            if(body[i] != other.body[i])
+            {
+                return body[i] < other.body[i];
+            }
+        }
+        return false;
+    }
+
+   public:
+    Key() = default;
+    Key(const T *p)
+    {
+        for(size_t i = 0; i < N; ++i)
+        {
+            body[i] = p[i];
+        }
+    }
+    T &operator[](size_t index) { return body[index]; }
+    T operator[](size_t index) const { return body[index]; }
+    // The first component goes to the most significant bits, so packed
+    // values order the same way as the keys themselves.
+    uint64_t packed() const
+    {
+        static_assert(KeyPacking<N, T>::enabled, "key does not fit into 64 bits");
+        uint64_t result = 0;
+        for(size_t i = 0; i < N; ++i)
+        {
+            // Two half shifts: a single shift by 64 bits is undefined.
+            result = ((result << (4 * sizeof(T))) << (4 * sizeof(T))) | uint64_t(body[i]);
+        }
+        return result;
+    }
+    bool operator==(const Key &other) const { return equal(other, packed_tag()); }
+    bool operator!=(const Key &other) const { return !equal(other, packed_tag()); }
+    bool operator<(const Key &other) const { return less(other, packed_tag()); }
+    bool operator>(const Key &other) const { return other.less(*this, packed_tag()); }
+
+    friend std::ostream &operator<<(std::ostream &str, const Key &key)
+    {
+        str << '(' << int(key[0]);
+        for(size_t i = 1; i < N; ++i)
+        {
+            str << ", " << int(key[i]);
+        }
+        str << ")";
+        return str;
+    }
+};
+
+static_assert(std::is_trivially_copyable<Key<3, unsigned char> >::value,
+              "keys are stored inline and copied bitwise");
@@ -0,0 +1,48 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+#include "histogram.hpp"
+#include "quantization.hpp"
+
+// Cluster label of every quantized color, indexed by the concatenated
+// component levels, so labeling a pixel is one table load. The table has
+// LEVELS^3 entries: 16M for 8-bit keys, 32K for 5-bit ones. Label is
+// uint8_t for up to 256 clusters and uint16_t beyond that. Colors that are
+// not in the histogram get label 0.
+template <unsigned Bits, typename Label>
+class LabelTable
+{
+    typedef Quantizer<Bits> Quant;
+
+    std::vector<Label> table;
+
+   public:
+    static const size_t SIZE = Quant::LEVELS * Quant::LEVELS * Quant::LEVELS;
+
+    template <typename C>
+    LabelTable(const Histogram<3, unsigned char, C> &hist, const std::vector<uint32_t> &labels);
+
+    static size_t index(unsigned char c0, unsigned char c1, unsigned char c2)
+    {
+        return (size_t(Quant::level(c0)) << (2 * Bits)) | (size_t(Quant::level(c1)) << Bits) |
+               size_t(Quant::level(c2));
+    }
+    Label operator()(unsigned char c0, unsigned char c1, unsigned char c2) const
+    {
+        return table[index(c0, c1, c2)];
+    }
+};
+
+template <unsigned Bits, typename Label>
+template <typename C>
+LabelTable<Bits, Label>::LabelTable(const Histogram<3, unsigned char, C> &hist,
+                                    const std::vector<uint32_t> &labels)
+    : table(SIZE, 0)
+{
+    for(size_t bin = 0; bin < hist.size(); ++bin)
+    {
+        const Key<3, unsigned char> &key = hist[bin].key;
+        table[index(key[0], key[1], key[2])] = Label(labels[bin]);
+    }
+}
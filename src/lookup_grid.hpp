@@ -0,0 +1,141 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+#include "key.hpp"
+
+// Nearest center lookup over the 8-bit color cube, split into cells of
+// 2^CellBits values per side (32^3 cells by default). Every cell records
+// the centers that can be nearest to some color inside it. A cell with a
+// single candidate answers with one table load; the others, along cluster
+// boundaries, compare the color against their few candidates only. Ties go
+// to the lower center index, as in KMeansIteration.
+template <unsigned CellBits = 3>
+class LookupGrid
+{
+   public:
+    static const unsigned SIDE = 256 >> CellBits;
+    static const unsigned CELLS = SIDE * SIDE * SIDE;
+
+   private:
+    // Set in cells entries that point into candidates instead of holding
+    // the label
+    static const uint32_t AMBIGUOUS = 0x80000000;
+
+    std::vector<Key<3, double> > centers;
+    std::vector<uint32_t> cells;
+    // Candidate count followed by the candidates, per ambiguous cell
+    std::vector<uint32_t> candidates;
+
+    static void box_distances(const Key<3, double> &center, const unsigned *low,
+                              double &nearest, double &farthest);
+
+   public:
+    explicit LookupGrid(const std::vector<Key<3, double> > &_centers);
+
+    uint32_t label(unsigned char c0, unsigned char c1, unsigned char c2) const;
+    // Number of cells that need distance checks
+    size_t ambiguous() const;
+};
+
+// Smallest and largest squared distance from center to the colors of the
+// cell starting at low.
+template <unsigned CellBits>
+void LookupGrid<CellBits>::box_distances(const Key<3, double> &center, const unsigned *low,
+                                         double &nearest, double &farthest)
+{
+    nearest = 0.;
+    farthest = 0.;
+    for(size_t i = 0; i < 3; ++i)
+    {
+        const double lo = double(low[i]);
+        const double hi = double(low[i] + (1u << CellBits) - 1);
+        const double c = center[i];
+        const double below = c < lo ? lo - c : (c > hi ? c - hi : 0.);
+        const double above = std::max(std::abs(c - lo), std::abs(c - hi));
+        nearest += below * below;
+        farthest += above * above;
+    }
+}
+
+template <unsigned CellBits>
+LookupGrid<CellBits>::LookupGrid(const std::vector<Key<3, double> > &_centers)
+    : centers(_centers), cells(CELLS, 0)
+{
+    const size_t k = centers.size();
+    std::vector<double> nearest(k), farthest(k);
+    std::vector<uint32_t> cell_candidates;
+    for(unsigned cell = 0; cell < CELLS; ++cell)
+    {
+        const unsigned low[3] = {(cell / (SIDE * SIDE)) << CellBits,
+                                 (cell / SIDE % SIDE) << CellBits, (cell % SIDE) << CellBits};
+        // No color of the cell is farther than bound from its nearest center
+        double bound = 0.;
+        for(size_t cntr = 0; cntr < k; ++cntr)
+        {
+            box_distances(centers[cntr], low, nearest[cntr], farthest[cntr]);
+            bound = cntr == 0 ? farthest[cntr] : std::min(bound, farthest[cntr]);
+        }
+        cell_candidates.clear();
+        for(size_t cntr = 0; cntr < k; ++cntr)
+        {
+            if(nearest[cntr] <= bound)
+            {
+                cell_candidates.push_back(uint32_t(cntr));
+            }
+        }
+        if(cell_candidates.size() == 1)
+        {
+            cells[cell] = cell_candidates[0];
+            continue;
+        }
+        cells[cell] = AMBIGUOUS | uint32_t(candidates.size());
+        candidates.push_back(uint32_t(cell_candidates.size()));
+        candidates.insert(candidates.end(), cell_candidates.begin(), cell_candidates.end());
+    }
+}
+
+template <unsigned CellBits>
+inline uint32_t LookupGrid<CellBits>::label(unsigned char c0, unsigned char c1,
+                                            unsigned char c2) const
+{
+    const uint32_t entry =
+        cells[((c0 >> CellBits) * SIDE + (c1 >> CellBits)) * SIDE + (c2 >> CellBits)];
+    if(!(entry & AMBIGUOUS))
+    {
+        return entry;
+    }
+    const uint32_t *candidate = &candidates[entry & ~AMBIGUOUS];
+    const uint32_t count = *candidate++;
+    const double key[3] = {double(c0), double(c1), double(c2)};
+    uint32_t nearest_cntr = 0;
+    double min_dist = 0.;
+    for(uint32_t i = 0; i < count; ++i)
+    {
+        double dist = 0.;
+        for(size_t j = 0; j < 3; ++j)
+        {
+            double d = key[j] - centers[candidate[i]][j];
+            dist += d * d;
+        }
+        if(i == 0 || dist < min_dist)
+        {
+            min_dist = dist;
+            nearest_cntr = candidate[i];
+        }
+    }
+    return nearest_cntr;
+}
+
+template <unsigned CellBits>
+size_t LookupGrid<CellBits>::ambiguous() const
+{
+    size_t result = 0;
+    for(unsigned cell = 0; cell < CELLS; ++cell)
+    {
+        result += (cells[cell] & AMBIGUOUS) ? 1 : 0;
+    }
+    return result;
+}
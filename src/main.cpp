@@ -1,19 +1,268 @@
+#include <stdlib.h>
 #include <string.h>
+#include <algorithm>
 #include <chrono>
 #include <iostream>
-#include <map>
+#include <limits>
+#include <memory>
 #include <string>
+#include <thread>
+#include <vector>
+#include "dense_histogram.hpp"
 #include "histogram.hpp"
+#include "image_histogram.hpp"
+#include "image_labeling.hpp"
 #include "imageformats.hpp"
 #include "imageio.hpp"
 #include "k-means.hpp"
+#include "label_table.hpp"
+#include "lookup_grid.hpp"
+#include "parallel.hpp"
 #include "pixelformats.hpp"
+#include "quantization.hpp"
 
-template <size_t N, typename T>
+const char* const USAGE =
+    "command: ./program_name path_to_image number_of_clusters|MIN:MAX [--threads N] [--bits 4..8] "
+    "[--sort count|key|none] [--algorithm lloyd|hamerly|minibatch] "
+    "[--seed S] [--seed-trials T] [--batch B] [--time-limit SECONDS] "
+    "[--max-iterations I] [--tolerance T] [--max-changes C] "
+    "[--init-centers FILE] [--save-centers FILE] [--restarts R] [--output FILE] "
+    "[--dump-every N] [--histogram-image FILE] [--labels FILE]\n"
+    "--max-iterations caps the iterations of every algorithm (mini-batch counts batches) "
+    "and must be at least 1, default 100";
+
+struct Options
+{
+    std::vector<const char*> positional;
+    size_t threads;
+    // Bits per color component kept in the histogram keys
+    unsigned bits;
+    SortOrder sort;
+    KMeans::Algorithm algorithm;
+    // k-means++ seeding
+    uint64_t seed;
+    size_t seed_trials;
+    // Mini-batch options; the seed, iteration cap and time limit are shared.
+    // convergence.max_iterations is at least 1 and caps every algorithm
+    KMeans::MiniBatchOptions mini_batch;
+    KMeans::Convergence convergence;
+    // Independently seeded runs to pick the best of
+    size_t restarts;
+    // Wall clock budget of mini-batch runs and restarts, 0 for none
+    double time_limit;
+    // Centers files for warm starts
+    const char* init_centers;
+    const char* save_centers;
+    // Final segmentation image
+    const char* output;
+    // Write clustiterN.bmp and histfN.bmp every that many iterations, 0 for never
+    size_t dump_every;
+    // Histogram projection image, not written when NULL
+    const char* histogram_image;
+    // Per-pixel cluster indices as a 16-bit PGM, not written when NULL
+    const char* labels;
+
+    Options()
+        : threads( std::thread::hardware_concurrency() ),
+          bits( 8 ),
+          sort( SORT_BY_COUNT ),
+          algorithm( KMeans::LLOYD ),
+          seed( 42 ),
+          seed_trials( 1 ),
+          restarts( 1 ),
+          time_limit( 0. ),
+          init_centers( NULL ),
+          save_centers( NULL ),
+          output( "segmentation.bmp" ),
+          dump_every( 0 ),
+          histogram_image( NULL ),
+          labels( NULL )
+    {
+        if( threads == 0 )
+        {
+            threads = 1;
+        }
+    }
+};
+
+bool parse_options( int argc, char** argv, Options& options )
+{
+    for( int a = 1; a < argc; ++a )
+    {
+        if( strcmp( argv[a], "--threads" ) == 0 )
+        {
+            if( a + 1 >= argc || atoi( argv[a + 1] ) <= 0 )
+            {
+                return false;
+            }
+            options.threads = atoi( argv[++a] );
+        }
+        else if( strcmp( argv[a], "--bits" ) == 0 )
+        {
+            if( a + 1 >= argc || atoi( argv[a + 1] ) < 4 || atoi( argv[a + 1] ) > 8 )
+            {
+                return false;
+            }
+            options.bits = atoi( argv[++a] );
+        }
+        else if( strcmp( argv[a], "--sort" ) == 0 )
+        {
+            if( a + 1 >= argc )
+            {
+                return false;
+            }
+            ++a;
+            if( strcmp( argv[a], "count" ) == 0 )
+                options.sort = SORT_BY_COUNT;
+            else if( strcmp( argv[a], "key" ) == 0 )
+                options.sort = SORT_BY_KEY;
+            else if( strcmp( argv[a], "none" ) == 0 )
+                options.sort = SORT_NONE;
+            else
+                return false;
+        }
+        else if( strcmp( argv[a], "--algorithm" ) == 0 )
+        {
+            if( a + 1 >= argc )
+            {
+                return false;
+            }
+            ++a;
+            if( strcmp( argv[a], "lloyd" ) == 0 )
+                options.algorithm = KMeans::LLOYD;
+            else if( strcmp( argv[a], "hamerly" ) == 0 )
+                options.algorithm = KMeans::HAMERLY;
+            else if( strcmp( argv[a], "minibatch" ) == 0 )
+                options.algorithm = KMeans::MINI_BATCH;
+            else
+                return false;
+        }
+        else if( strcmp( argv[a], "--seed" ) == 0 )
+        {
+            if( a + 1 >= argc )
+            {
+                return false;
+            }
+            options.seed = strtoull( argv[++a], NULL, 10 );
+        }
+        else if( strcmp( argv[a], "--seed-trials" ) == 0 )
+        {
+            if( a + 1 >= argc || atoi( argv[a + 1] ) <= 0 )
+            {
+                return false;
+            }
+            options.seed_trials = atoi( argv[++a] );
+        }
+        else if( strcmp( argv[a], "--batch" ) == 0 )
+        {
+            if( a + 1 >= argc || atoi( argv[a + 1] ) <= 0 )
+            {
+                return false;
+            }
+            options.mini_batch.batch_size = atoi( argv[++a] );
+        }
+        else if( strcmp( argv[a], "--max-iterations" ) == 0 )
+        {
+            if( a + 1 >= argc || atoi( argv[a + 1] ) <= 0 )
+            {
+                return false;
+            }
+            options.convergence.max_iterations = atoi( argv[++a] );
+        }
+        else if( strcmp( argv[a], "--tolerance" ) == 0 )
+        {
+            if( a + 1 >= argc || atof( argv[a + 1] ) < 0. )
+            {
+                return false;
+            }
+            options.convergence.tolerance = atof( argv[++a] );
+        }
+        else if( strcmp( argv[a], "--max-changes" ) == 0 )
+        {
+            if( a + 1 >= argc || atoi( argv[a + 1] ) < 0 )
+            {
+                return false;
+            }
+            options.convergence.max_changed = atoi( argv[++a] );
+        }
+        else if( strcmp( argv[a], "--restarts" ) == 0 )
+        {
+            if( a + 1 >= argc || atoi( argv[a + 1] ) <= 0 )
+            {
+                return false;
+            }
+            options.restarts = atoi( argv[++a] );
+        }
+        else if( strcmp( argv[a], "--init-centers" ) == 0 )
+        {
+            if( a + 1 >= argc )
+            {
+                return false;
+            }
+            options.init_centers = argv[++a];
+        }
+        else if( strcmp( argv[a], "--save-centers" ) == 0 )
+        {
+            if( a + 1 >= argc )
+            {
+                return false;
+            }
+            options.save_centers = argv[++a];
+        }
+        else if( strcmp( argv[a], "--output" ) == 0 )
+        {
+            if( a + 1 >= argc )
+            {
+                return false;
+            }
+            options.output = argv[++a];
+        }
+        else if( strcmp( argv[a], "--dump-every" ) == 0 )
+        {
+            if( a + 1 >= argc || atoi( argv[a + 1] ) < 0 )
+            {
+                return false;
+            }
+            options.dump_every = atoi( argv[++a] );
+        }
+        else if( strcmp( argv[a], "--histogram-image" ) == 0 )
+        {
+            if( a + 1 >= argc )
+            {
+                return false;
+            }
+            options.histogram_image = argv[++a];
+        }
+        else if( strcmp( argv[a], "--labels" ) == 0 )
+        {
+            if( a + 1 >= argc )
+            {
+                return false;
+            }
+            options.labels = argv[++a];
+        }
+        else if( strcmp( argv[a], "--time-limit" ) == 0 )
+        {
+            if( a + 1 >= argc || atof( argv[a + 1] ) < 0. )
+            {
+                return false;
+            }
+            options.time_limit = atof( argv[++a] );
+        }
+        else
+        {
+            options.positional.push_back( argv[a] );
+        }
+    }
+    return true;
+}
+
+template <unsigned Bits, size_t N, typename T, typename C>
 ColorByteImage draw_clusters( const ColorByteImage& image,
-                              const Histogram<N, T>& hist,
-                              const std::vector<std::set<size_t> >& clusters,
+                              const Histogram<N, T, C>& hist,
+                              const std::vector<uint32_t>& labels,
                               const ColorBytePixel* colors,
+                              ThreadPool& pool,
                               const size_t nonce = 0 )
 {
     ColorByteImage result( image.Width(), image.Height() );
@@ -24,21 +273,15 @@ ColorByteImage draw_clusters( const ColorByteImage& image,
     ColorFloatImage hist_image( hist_w, hist_h );
     hist_image.for_each_pixel( []( ColorFloatPixel ) { return ColorFloatPixel( 0.f ); } );
 
-    std::map<Key<N, T>, size_t> color_map;
-    for( size_t cluster = 0; cluster < clusters.size(); ++cluster )
+    for( size_t bin = 0; bin < hist.size(); ++bin )
     {
-        for( auto item = clusters[cluster].begin(); item != clusters[cluster].end(); ++item )
-        {
-            color_map.insert( std::pair<Key<N, T>, size_t>( hist[*item].key, cluster ) );
-
-            const float k = 0.15f;
-            float alpha = hist[*item].count / 256.f * k;
-            alpha = ( alpha > 1.f ) ? 1.f : alpha;
-            ColorFloatPixel color = alpha * ( ColorFloatPixel( 255.f ) + -1.f * colors[cluster] );
-            hist_image( 256 * 0 + hist[*item].key[0], 255 - hist[*item].key[1] ) += color;
-            hist_image( 256 * 1 + hist[*item].key[0], 255 - hist[*item].key[2] ) += color;
-            hist_image( 256 * 2 + hist[*item].key[1], 255 - hist[*item].key[2] ) += color;
-        }
+        const float k = 0.15f;
+        float alpha = hist[bin].count / 256.f * k;
+        alpha = ( alpha > 1.f ) ? 1.f : alpha;
+        ColorFloatPixel color = alpha * ( ColorFloatPixel( 255.f ) + -1.f * colors[labels[bin]] );
+        hist_image( 256 * 0 + hist[bin].key[0], 255 - hist[bin].key[1] ) += color;
+        hist_image( 256 * 1 + hist[bin].key[0], 255 - hist[bin].key[2] ) += color;
+        hist_image( 256 * 2 + hist[bin].key[1], 255 - hist[bin].key[2] ) += color;
     }
     for( size_t j = 0; j < hist_h; ++j )
     {
@@ -51,39 +294,53 @@ ColorByteImage draw_clusters( const ColorByteImage& image,
     std::string fname = std::string( "histf" ) + std::to_string( nonce ) + std::string( ".bmp" );
     ImageIO::ImageToFile( hist_image, fname.c_str() );
 
-    for( int j = 0; j < image.Height(); ++j )
+    const uint32_t clusters = *std::max_element( labels.begin(), labels.end() ) + 1;
+    if( clusters <= 256 )
     {
-        for( int i = 0; i < image.Width(); ++i )
-        {
-            unsigned char _key[3] = {image( i, j ).r, image( i, j ).g, image( i, j ).b};
-            Key<3, unsigned char> key( &( _key[0] ) );
-            size_t color_number = color_map[key];
-            result( i, j ) = colors[color_number];
-        }
+        label_image( image, LabelTable<Bits, uint8_t>( hist, labels ), colors, pool, result );
+    }
+    else
+    {
+        label_image( image, LabelTable<Bits, uint16_t>( hist, labels ), colors, pool, result );
     }
     return result;
 }
 
-int main( int argc, char** argv )
+// Colors every pixel by the nearest of the final centers. Unlike
+// draw_clusters this needs no histogram, so it labels any image. labels,
+// when not NULL, receives the center index of every pixel.
+template <unsigned Bits, unsigned CellBits>
+ColorByteImage draw_segmentation( const ColorByteImage& image,
+                                  const LookupGrid<CellBits>& grid,
+                                  const ColorBytePixel* colors,
+                                  ThreadPool& pool,
+                                  LabelImage* labels = NULL )
 {
-    if (argc < 2) {
-        std::cout << "command: ./program_name path_to_image number_of_clusters" << std::endl;
-        return -1;
-    }
-    ColorByteImage image = ImageIO::FileToColorByteImage( argv[1] );
-    Histogram<3, unsigned char> hist;
+    typedef Quantizer<Bits> Quant;
+    ColorByteImage result( image.Width(), image.Height() );
+    label_image( image,
+                 [&grid]( unsigned char r, unsigned char g, unsigned char b ) {
+                     return grid.label( Quant::apply( r ), Quant::apply( g ), Quant::apply( b ) );
+                 },
+                 colors, pool, result, labels );
+    return result;
+}
+
+template <unsigned Bits>
+int segment( const Options& options )
+{
+    ColorByteImage image = ImageIO::FileToColorByteImage( options.positional[0] );
+    Histogram<3, unsigned char, uint32_t> hist;
+    ThreadPool pool( options.threads );
 
     std::chrono::time_point<std::chrono::system_clock> start_time, end_time;
     start_time = std::chrono::system_clock::now();
 
-    for( int j = 0; j < image.Height(); ++j )
     {
-        for( int i = 0; i < image.Width(); ++i )
-        {
-            unsigned char _key[3] = {image( i, j ).r, image( i, j ).g, image( i, j ).b};
-            Key<3, unsigned char> key( &( _key[0] ) );
-            hist.add( 1., key );
-        }
+        // The dense counters are only needed until the bins are compacted
+        DenseHistogram<Bits> dense;
+        build_histogram( dense, image, pool );
+        dense.compact( hist );
     }
 
     end_time = std::chrono::system_clock::now();
@@ -93,7 +350,7 @@ int main( int argc, char** argv )
 
     start_time = std::chrono::system_clock::now();
 
-    hist.sort();
+    hist.sort( options.sort );
 
     end_time = std::chrono::system_clock::now();
     std::chrono::duration<double> sort_second = end_time - start_time;
@@ -101,11 +358,23 @@ int main( int argc, char** argv )
 
     start_time = std::chrono::system_clock::now();
 
-    hist.rebuild_tree();
+    // The tree is still valid when the bins were left in place.
+    if( options.sort != SORT_NONE )
+    {
+        hist.rebuild_tree();
+    }
 
     end_time = std::chrono::system_clock::now();
     std::chrono::duration<double> rebuild_second = end_time - start_time;
     std::cout << "Rebuild tree time: " << rebuild_second.count() << "s" << std::endl;
+
+    start_time = std::chrono::system_clock::now();
+
+    const FlatHistogram<3, unsigned char> flat = hist.freeze();
+
+    end_time = std::chrono::system_clock::now();
+    std::chrono::duration<double> freeze_second = end_time - start_time;
+    std::cout << "Freeze time: " << freeze_second.count() << "s" << std::endl;
     double count = 0;
     for( auto it = hist.begin(); it != hist.end(); ++it )
     {
@@ -114,65 +383,256 @@ int main( int argc, char** argv )
     std::cout << "all: " << count << std::endl;
     std::cout << "hist size = " << hist.size() << std::endl;
 
-    const size_t hist_w = 256 * 3;
-    const size_t hist_h = 256;
+    if( options.histogram_image )
+    {
+        const size_t hist_w = 256 * 3;
+        const size_t hist_h = 256;
+
+        GrayscaleFloatImage hist_image( hist_w, hist_h );
+        hist_image.for_each_pixel( []( float ) { return 255.f; } );
+        const float k = 0.15f;
+        for( size_t i = 0; i < hist.size(); ++i )
+        {
+            hist_image( 256 * 0 + hist[i].key[0], 255 - hist[i].key[1] ) -= hist[i].count * k;
+            hist_image( 256 * 1 + hist[i].key[0], 255 - hist[i].key[2] ) -= hist[i].count * k;
+            hist_image( 256 * 2 + hist[i].key[1], 255 - hist[i].key[2] ) -= hist[i].count * k;
+        }
+        ImageIO::ImageToFile( hist_image, options.histogram_image );
+    }
+
+    std::vector<uint32_t> labels;
+    KMeans::HamerlyBounds<3> bounds;
 
-    GrayscaleFloatImage hist_image( hist_w, hist_h );
-    hist_image.for_each_pixel( []( float ) { return 255.f; } );
-    const float k = 0.15f;
-    for( size_t i = 0; i < hist.size(); ++i )
+    if( options.positional.size() < 2 )
+    {
+        std::cout << USAGE << std::endl;
+        return -1;
+    }
+    if( atoi( options.positional[1] ) < 1 )
     {
-        hist_image( 256 * 0 + hist[i].key[0], 255 - hist[i].key[1] ) -= hist[i].count * k;
-        hist_image( 256 * 1 + hist[i].key[0], 255 - hist[i].key[2] ) -= hist[i].count * k;
-        hist_image( 256 * 2 + hist[i].key[1], 255 - hist[i].key[2] ) -= hist[i].count * k;
+        std::cout << USAGE << std::endl;
+        return -1;
+    }
+    size_t number_of_clusters = atoi( options.positional[1] );
+    // Restarts and sweeps run Lloyd iterations, which Hamerly reproduces
+    // exactly but mini-batch does not
+    if( options.restarts > 1 && options.algorithm == KMeans::MINI_BATCH )
+    {
+        std::cout << "--restarts cannot be combined with --algorithm minibatch" << std::endl;
+        return -1;
+    }
+    std::vector<Key<3, double> > centers;
+    KMeans::Model<3> model;
+    // Set when the centers come out of a finished clustering run, which the
+    // main loop must not iterate further
+    bool clustered = false;
+    // A MIN:MAX cluster count sweeps k and keeps the elbow of the inertia curve
+    const char* range = strchr( options.positional[1], ':' );
+    if( range )
+    {
+        const size_t min_k = number_of_clusters;
+        if( atoi( range + 1 ) < 1 )
+        {
+            std::cout << USAGE << std::endl;
+            return -1;
+        }
+        const size_t max_k = atoi( range + 1 );
+        if( max_k < min_k )
+        {
+            std::cout << USAGE << std::endl;
+            return -1;
+        }
+        if( options.restarts > 1 )
+        {
+            std::cout << "--restarts cannot be combined with a cluster count range" << std::endl;
+            return -1;
+        }
+        if( options.algorithm == KMeans::MINI_BATCH )
+        {
+            std::cout << "--algorithm minibatch cannot be combined with a cluster count range"
+                      << std::endl;
+            return -1;
+        }
+        start_time = std::chrono::system_clock::now();
+
+        const std::vector<KMeans::Clustering<3> > candidates =
+            KMeans::KSweep<3>( flat, min_k, max_k, options.convergence, pool, options.seed );
+        const size_t best = KMeans::SelectK( candidates );
+
+        end_time = std::chrono::system_clock::now();
+        std::chrono::duration<double> sweep_second = end_time - start_time;
+        for( size_t c = 0; c < candidates.size(); ++c )
+        {
+            std::cout << "k = " << min_k + c << ": inertia " << candidates[c].inertia << ", "
+                      << candidates[c].iterations << " iterations" << std::endl;
+        }
+        number_of_clusters = min_k + best;
+        centers = candidates[best].centers;
+        labels = candidates[best].labels;
+        clustered = true;
+        std::cout << "Sweep time: " << sweep_second.count() << "s, selected k = "
+                  << number_of_clusters << std::endl;
     }
-    ImageIO::ImageToFile( hist_image, "histogram.bmp" );
+    else
+    {
+        // Warm started centers are kept, anything else is seeded afresh
+        bool seeded = false;
+        if( options.init_centers && KMeans::LoadModel( options.init_centers, model ) )
+        {
+            centers = KMeans::WarmStartCenters( model, number_of_clusters, flat, options.seed,
+                                                options.seed_trials, 0.25, &seeded );
+            std::cout << ( seeded ? "Warm start from " : "Fresh seeding, could not reuse " )
+                      << options.init_centers << std::endl;
+        }
+        else if( options.init_centers )
+        {
+            std::cout << "Cannot read centers from " << options.init_centers << std::endl;
+        }
+
+        if( !seeded && options.restarts > 1 )
+        {
+            start_time = std::chrono::system_clock::now();
+
+            size_t completed = 0;
+            const KMeans::Clustering<3> best = KMeans::BestOfRestarts<3>(
+                flat, number_of_clusters, options.restarts, options.convergence, pool,
+                options.seed, options.seed_trials, options.time_limit, &completed );
+            centers = best.centers;
+            labels = best.labels;
+            clustered = true;
 
-    const int N_TEST = 9;
-    ColorBytePixel colors[N_TEST] = {
+            end_time = std::chrono::system_clock::now();
+            std::chrono::duration<double> restarts_second = end_time - start_time;
+            std::cout << "Restarts time: " << restarts_second.count() << "s, " << completed
+                      << " of " << options.restarts << " runs converged, best inertia "
+                      << best.inertia << std::endl;
+        }
+        else if( centers.empty() )
+        {
+            centers = KMeans::InitClusterCenters( number_of_clusters, flat, options.seed,
+                                                  options.seed_trials );
+        }
+    }
+    std::vector<ColorBytePixel> colors = {
         ColorBytePixel( 255, 0, 0 ),     ColorBytePixel( 0, 255, 0 ),
         ColorBytePixel( 0, 0, 255 ),     ColorBytePixel( 255, 255, 0 ),
         ColorBytePixel( 0, 255, 255 ),   ColorBytePixel( 255, 0, 255 ),
         ColorBytePixel( 255, 127, 127 ), ColorBytePixel( 127, 127, 255 ),
         ColorBytePixel( 127, 255, 127 )};
-
-    std::vector<std::set<size_t> > clusters;
-
-    if (argc < 3) {
-        std::cout << "command: ./program_name path_to_image number_of_clusters" << std::endl;
-        return -1;
+    // Further clusters get scattered colors
+    for( size_t c = colors.size(); c < number_of_clusters; ++c )
+    {
+        colors.push_back( ColorBytePixel( ( c * 97 ) % 256, ( c * 57 + 80 ) % 256,
+                                          ( c * 31 + 160 ) % 256 ) );
     }
-    const size_t number_of_clusters = atoi( argv[2] );
-    auto centers = KMeans::InitClusterCenters( number_of_clusters, hist );
-    double sum_shift = 0.;
-    const double eps = 0.001;
-    int i = 0;
-    ColorByteImage im( image.Width(), image.Height() );
-    do
+
+    if( !clustered )
     {
-        ++i;
-        start_time = std::chrono::system_clock::now();
+        KMeans::IterationResult result;
+        double previous_inertia = std::numeric_limits<double>::infinity();
+        bool converged = false;
+        int i = 0;
+        do
+        {
+            ++i;
+            start_time = std::chrono::system_clock::now();
 
-        sum_shift = KMeans::KMeansIteration( hist, centers, clusters );
+            if( options.algorithm == KMeans::MINI_BATCH )
+            {
+                KMeans::MiniBatchOptions mini_batch = options.mini_batch;
+                mini_batch.seed = options.seed;
+                mini_batch.max_iterations = options.convergence.max_iterations;
+                mini_batch.max_seconds = options.time_limit;
+                result = KMeans::MiniBatchKMeans( flat, centers, labels, mini_batch );
+                // The budget is spent in one call
+                converged = true;
+            }
+            else if( options.algorithm == KMeans::HAMERLY )
+            {
+                result = KMeans::HamerlyIteration( flat, centers, labels, bounds );
+            }
+            else
+            {
+                result = KMeans::KMeansIteration( flat, centers, labels, pool );
+            }
+            converged = converged || options.convergence.done( result, previous_inertia, i );
+            previous_inertia = result.inertia;
 
-        end_time = std::chrono::system_clock::now();
-        std::chrono::duration<double> clust_second = end_time - start_time;
-        std::cout << "Iteration " << i << ": clustering time: " << clust_second.count() << "s"
-                  << std::endl;
+            end_time = std::chrono::system_clock::now();
+            std::chrono::duration<double> clust_second = end_time - start_time;
+            std::cout << "Iteration " << i << ": clustering time: " << clust_second.count() << "s"
+                      << std::endl;
 
-        start_time = std::chrono::system_clock::now();
+            if( options.dump_every && i % options.dump_every == 0 )
+            {
+                start_time = std::chrono::system_clock::now();
 
-        im = draw_clusters( image, hist, clusters, colors, i );
-        std::string filename =
-            std::string( "clustiter" ) + std::to_string( i ) + std::string( ".bmp" );
-        ImageIO::ImageToFile( im, filename.c_str() );
+                ColorByteImage im =
+                    draw_clusters<Bits>( image, hist, labels, colors.data(), pool, i );
+                std::string filename =
+                    std::string( "clustiter" ) + std::to_string( i ) + std::string( ".bmp" );
+                ImageIO::ImageToFile( im, filename.c_str() );
 
-        end_time = std::chrono::system_clock::now();
-        std::chrono::duration<double> draw_second = end_time - start_time;
-        std::cout << "Drawing time: " << draw_second.count() << "s" << std::endl;
+                end_time = std::chrono::system_clock::now();
+                std::chrono::duration<double> draw_second = end_time - start_time;
+                std::cout << "Drawing time: " << draw_second.count() << "s" << std::endl;
+            }
 
-        std::cout << "Shift: " << sum_shift << std::endl << std::endl;
-    } while( sum_shift > eps );
+            std::cout << "Shift: " << result.shift << std::endl;
+            std::cout << "Changed labels: " << result.changed << std::endl;
+            std::cout << "Inertia: " << result.inertia << std::endl << std::endl;
+        } while( !converged );
+    }
+
+    start_time = std::chrono::system_clock::now();
+
+    if( options.save_centers &&
+        !KMeans::SaveModel( options.save_centers, KMeans::MakeModel( flat, centers ) ) )
+    {
+        std::cout << "Cannot write centers to " << options.save_centers << std::endl;
+    }
+
+    const LookupGrid<> grid( centers );
+    std::unique_ptr<LabelImage> label_plane;
+    if( options.labels && centers.size() <= 0x10000 )
+    {
+        label_plane.reset( new LabelImage( image.Width(), image.Height() ) );
+    }
+    const ColorByteImage im =
+        draw_segmentation<Bits>( image, grid, colors.data(), pool, label_plane.get() );
+    ImageIO::ImageToFile( im, options.output );
+    if( options.labels && ( !label_plane || !save_labels( options.labels, *label_plane ) ) )
+    {
+        std::cout << "Cannot write labels to " << options.labels << std::endl;
+    }
+
+    end_time = std::chrono::system_clock::now();
+    std::chrono::duration<double> label_second = end_time - start_time;
+    std::cout << "Labeling time: " << label_second.count() << "s (" << grid.ambiguous() << " of "
+              << grid.CELLS << " grid cells ambiguous)" << std::endl;
 
     return 0;
-}
\ No newline at end of file
+}
+
+int main( int argc, char** argv )
+{
+    Options options;
+    if( !parse_options( argc, argv, options ) || options.positional.size() < 1 )
+    {
+        std::cout << USAGE << std::endl;
+        return -1;
+    }
+    switch( options.bits )
+    {
+        case 4:
+            return segment<4>( options );
+        case 5:
+            return segment<5>( options );
+        case 6:
+            return segment<6>( options );
+        case 7:
+            return segment<7>( options );
+        default:
+            return segment<8>( options );
+    }
+}
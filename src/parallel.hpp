@@ -0,0 +1,123 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Fixed set of worker threads executing indexed tasks.
+// run() hands out task indices dynamically to the workers and to the calling
+// thread and returns once every task has finished. It is not reentrant: a
+// task must not call run() on the pool executing it.
+class ThreadPool
+{
+    std::vector<std::thread> workers;
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::condition_variable done;
+    const std::function<void(size_t)> *job;
+    size_t tasks;
+    std::atomic<size_t> next;
+    size_t active;
+    size_t generation;
+    bool stop;
+
+    void work()
+    {
+        for(size_t i = next++; i < tasks; i = next++)
+        {
+            (*job)(i);
+        }
+    }
+    void loop();
+
+   public:
+    // threads is the total number of threads, the caller included.
+    explicit ThreadPool(size_t threads);
+    ThreadPool(const ThreadPool &) = delete;
+    ThreadPool &operator=(const ThreadPool &) = delete;
+    ~ThreadPool();
+
+    size_t size() const { return workers.size() + 1; }
+    void run(size_t n, const std::function<void(size_t)> &f);
+};
+
+inline ThreadPool::ThreadPool(size_t threads)
+    : job(NULL), tasks(0), next(0), active(0), generation(0), stop(false)
+{
+    for(size_t i = 1; i < threads; ++i)
+    {
+        workers.push_back(std::thread(&ThreadPool::loop, this));
+    }
+}
+
+inline ThreadPool::~ThreadPool()
+{
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        stop = true;
+    }
+    wake.notify_all();
+    for(size_t i = 0; i < workers.size(); ++i)
+    {
+        workers[i].join();
+    }
+}
+
+inline void ThreadPool::loop()
+{
+    size_t seen = 0;
+    while(true)
+    {
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            wake.wait(lock, [this, &seen] { return stop || generation != seen; });
+            if(stop)
+            {
+                return;
+            }
+            seen = generation;
+        }
+        work();
+        std::unique_lock<std::mutex> lock(mutex);
+        if(--active == 0)
+        {
+            done.notify_one();
+        }
+    }
+}
+
+inline void ThreadPool::run(size_t n, const std::function<void(size_t)> &f)
+{
+    if(workers.empty() || n <= 1)
+    {
+        for(size_t i = 0; i < n; ++i)
+        {
+            f(i);
+        }
+        return;
+    }
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        job = &f;
+        tasks = n;
+        next = 0;
+        active = workers.size();
+        ++generation;
+    }
+    wake.notify_all();
+    work();
+    std::unique_lock<std::mutex> lock(mutex);
+    done.wait(lock, [this] { return active == 0; });
+    job = NULL;
+}
+
+// Splits [0, n) into parts contiguous ranges of nearly equal length and
+// returns the bounds of range number part.
+inline void split_range(size_t n, size_t parts, size_t part, size_t &begin, size_t &end)
+{
+    begin = n * part / parts;
+    end = n * (part + 1) / parts;
+}
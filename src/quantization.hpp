@@ -0,0 +1,23 @@
+#pragma once
+
+#include <cstddef>
+
+// Reduces 8-bit color components to Bits bits.
+// level() is the index of the quantization bin, value() maps a bin back to
+// the 8-bit value at its center, so quantized keys stay in the usual
+// 0..255 range for distances and drawing. Bits = 8 is the identity.
+template <unsigned Bits>
+struct Quantizer
+{
+    static_assert(Bits >= 1 && Bits <= 8, "quantization must keep 1 to 8 bits per component");
+
+    static const unsigned SHIFT = 8 - Bits;
+    static const size_t LEVELS = size_t(1) << Bits;
+
+    static unsigned level(unsigned char c) { return c >> SHIFT; }
+    static unsigned char value(unsigned level)
+    {
+        return (unsigned char)((level << SHIFT) | ((1u << SHIFT) >> 1));
+    }
+    static unsigned char apply(unsigned char c) { return value(level(c)); }
+};
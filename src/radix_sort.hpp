@@ -0,0 +1,72 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <type_traits>
+#include <vector>
+
+// Stable LSD radix sort of (key, index) pairs by key, one byte per pass.
+// The byte histograms of all passes are gathered in a single sweep, and a
+// pass is skipped when every key has the same byte in it, so keys that
+// span few bytes (pixel counts, packed colors) take only a few passes.
+inline void radix_sort(std::vector<uint64_t> &keys, std::vector<uint32_t> &index)
+{
+    const size_t n = keys.size();
+    const size_t PASSES = sizeof(uint64_t);
+    std::vector<size_t> buckets(PASSES * 256, 0);
+    for(size_t i = 0; i < n; ++i)
+    {
+        uint64_t k = keys[i];
+        for(size_t pass = 0; pass < PASSES; ++pass)
+        {
+            ++buckets[pass * 256 + ((k >> (8 * pass)) & 0xFF)];
+        }
+    }
+
+    std::vector<uint64_t> keys_tmp(n);
+    std::vector<uint32_t> index_tmp(n);
+    for(size_t pass = 0; pass < PASSES; ++pass)
+    {
+        size_t *bucket = &(buckets[pass * 256]);
+        if(n == 0 || bucket[(keys[0] >> (8 * pass)) & 0xFF] == n)
+        {
+            continue;
+        }
+        size_t offset = 0;
+        for(size_t b = 0; b < 256; ++b)
+        {
+            size_t c = bucket[b];
+            bucket[b] = offset;
+            offset += c;
+        }
+        for(size_t i = 0; i < n; ++i)
+        {
+            size_t dst = bucket[(keys[i] >> (8 * pass)) & 0xFF]++;
+            keys_tmp[dst] = keys[i];
+            index_tmp[dst] = index[i];
+        }
+        keys.swap(keys_tmp);
+        index.swap(index_tmp);
+    }
+}
+
+// Map counts to unsigned integers with the same ordering.
+inline uint64_t radix_key(double value)
+{
+    uint64_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    return (bits >> 63) ? ~bits : (bits | (uint64_t(1) << 63));
+}
+
+inline uint64_t radix_key(float value)
+{
+    uint32_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    return (bits >> 31) ? ~bits : (bits | (uint32_t(1) << 31));
+}
+
+template <typename U>
+typename std::enable_if<std::is_unsigned<U>::value, uint64_t>::type radix_key(U value)
+{
+    return uint64_t(value);
+}